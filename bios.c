@@ -1,8 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <time.h>
 #include <sys/select.h>
@@ -28,6 +30,9 @@
 	- Core threads mask all signals except for USR1.
 	- The PIC thread receives all signals and dispatches them to
 	the right core thread by raising SIGUSR1.
+	- Interrupts are disabled in software: the USR1 handler leaves
+	interrupts pending while the core thread's enable flag is clear,
+	and cpu_enable_interrupts() dispatches them.
 
  */
 
@@ -49,9 +54,16 @@ typedef struct core
 	struct sigevent timer_sigevent;
 	timer_t timer_id;
 
+	/* Lazy timer: the requested deadline and the deadline the timer is armed for (0 if none) */
+	TimerDuration timer_deadline;
+	TimerDuration timer_armed;
+
 	volatile uint32_t intr_pending;
 	interrupt_handler* intvec[maximum_interrupt_no];
 
+	/* Set by cpu_core_restart(), so that the next halt does not sleep */
+	volatile int restart_token;
+
 
 #if defined(CORE_STATISTICS)
 	/* Statistics */
@@ -91,8 +103,63 @@ static pthread_barrier_t system_barrier, core_barrier;
 /* Flag that signals that PIC daemon should be active */
 static volatile sig_atomic_t PIC_active;
 
-/* Bit vector denoting halted cores */
-static _Atomic uint32_t halt_vector;
+/* 
+	A set of cores, as a bit vector of words. Each bit is updated atomically,
+	but a scan of the whole set is not atomic.
+ */
+#define CORE_SET_WORDS ((MAX_CORES+63)/64)
+typedef struct { uint64_t word[CORE_SET_WORDS]; } core_set_t;
+
+#define CORE_SET_WORD(c) ((c) / 64)
+#define CORE_SET_BIT(c) ((uint64_t)1 << ((c) % 64))
+
+/* Make the set empty */
+static inline void core_set_clear(core_set_t* set)
+{
+	for(uint w=0; w < CORE_SET_WORDS; w++)
+		__atomic_store_n(& set->word[w], 0, __ATOMIC_SEQ_CST);
+}
+
+/* Add core c to the set */
+static inline void core_set_add(core_set_t* set, uint c)
+{
+	__atomic_fetch_or(& set->word[CORE_SET_WORD(c)], CORE_SET_BIT(c), __ATOMIC_SEQ_CST);
+}
+
+/* Remove core c from the set, returning 1 if it was in it */
+static inline int core_set_remove(core_set_t* set, uint c)
+{
+	return (__atomic_fetch_and(& set->word[CORE_SET_WORD(c)], ~CORE_SET_BIT(c), __ATOMIC_SEQ_CST) 
+		& CORE_SET_BIT(c)) != 0;
+}
+
+/* 
+	Return the lowest core of the set which is not in the exclude set, or -1 
+	if there is none; count the cores in the set in *count 
+ */
+static inline int core_set_first(core_set_t* set, core_set_t* exclude, uint* count)
+{
+	int first = -1;
+	uint n = 0;
+	for(uint w=0; w < CORE_SET_WORDS; w++) {
+		uint64_t bits = __atomic_load_n(& set->word[w], __ATOMIC_RELAXED);
+		if(bits == 0) continue;
+		n += __builtin_popcountll(bits);
+		bits &= ~__atomic_load_n(& exclude->word[w], __ATOMIC_RELAXED);
+		if(first < 0 && bits != 0) first = w*64 + __builtin_ctzll(bits);
+	}
+	*count = n;
+	return first;
+}
+
+/* Set of halted cores */
+static core_set_t halt_vector;
+
+/* Set of parked cores (a subset of the halted cores) */
+static core_set_t park_vector;
+
+/* Number of cores that have been restarted, but have not yet left cpu_core_halt() */
+static _Atomic unsigned int waking_cores;
 
 /* PIC thread id */
 static pthread_t PIC_thread;
@@ -123,7 +190,9 @@ static void initialize()
 	physical_cores = get_nprocs();
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
-	USR1_sigaction.sa_flags = SA_SIGINFO;
+	/* USR1 is never blocked while the handler runs (it may not return for 
+	   a long time, if it switches context); interrupts are masked in software */
+	USR1_sigaction.sa_flags = SA_SIGINFO | SA_NODEFER;
 	sigemptyset(& USR1_sigaction.sa_mask);
 
 	/* Create the sigmask to block all signals, except USR1 */
@@ -157,6 +226,23 @@ static inline Core* curr_core() {
 }
 
 
+/*
+	The software interrupt-enable flag of the core.
+
+	The flag is kept per core thread (rather than in Core), so that each 
+	access compiles to a single %fs-relative instruction. A context may be
+	preempted and resumed on a different core; an access which first
+	computed the address of some core's flag could then update the 
+	flag of the wrong core.
+ */
+static _Thread_local volatile int intr_enabled;
+
+static inline int intr_flag_exchange(int val)
+{
+	return __atomic_exchange_n(& intr_enabled, val, __ATOMIC_SEQ_CST);
+}
+
+
 /*
 	Cause PIC daemon to loop. This needs to happen when we wish 
 	the PIC daemon to refresh the list of fds it is polling.
@@ -181,12 +267,20 @@ static void* core_thread(void* _core)
 	/* Clear pending bitvec */
 	core->intr_pending = 0;
 
+	/* No timer is armed */
+	core->timer_deadline = core->timer_armed = 0;
+
+	core->restart_token = 0;
+
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) 
 		core->intvec[i] = NULL;
 
 	cpu_core_id = core->id;
 
+	/* Cores boot with interrupts enabled */
+	intr_enabled = 1;
+
 	/* Set core signal mask */
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
 
@@ -309,6 +403,58 @@ static inline void raise_interrupt(Core* core, Interrupt intno)
 
 
 
+/*
+	The core timer is reprogrammed lazily. bios_set_timer() only records
+	a deadline, and arms the timer only if it would otherwise expire later
+	than the deadline (or not at all). bios_cancel_timer() only clears the 
+	deadline. When the timer expires, the ALARM is delivered only if the
+	deadline has been reached; if it is early, the timer is re-armed.
+
+	All this state is only accessed by the core itself, with interrupts
+	disabled.
+ */
+
+/* Expiries this early (in usec) are still delivered */
+#define TIMER_SLACK 500
+
+/* A monotonic clock in usec, consistent with the core timers */
+static inline TimerDuration get_monotonic_time()
+{
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
+}
+
+static void core_arm_timer(Core* core, TimerDuration deadline)
+{
+	struct itimerspec newtime = {
+		.it_value = {.tv_sec=deadline / 1000000, .tv_nsec=(deadline % 1000000) * 1000ull},
+		.it_interval = {.tv_sec=0, .tv_nsec=0}
+	};
+	CHECK(timer_settime(core->timer_id, TIMER_ABSTIME, &newtime, NULL));
+	core->timer_armed = deadline;
+}
+
+/*
+	Called when an ALARM is dispatched. Return 1 if the ALARM is due,
+	else 0 (canceled or early).
+ */
+static int core_alarm_due(Core* core)
+{
+	core->timer_armed = 0;
+
+	if(core->timer_deadline == 0) return 0;
+
+	if(core->timer_deadline > get_monotonic_time() + TIMER_SLACK) {
+		core_arm_timer(core, core->timer_deadline);
+		return 0;
+	}
+
+	core->timer_deadline = 0;
+	return 1;
+}
+
+
 /*
 	Dispatch any pending interrupts, lowest first.
 	Cease if an interrupt causes core change.
@@ -326,6 +472,8 @@ static inline void dispatch_interrupts(Core* core)
 #if defined(CORE_STATISTICS)
 		core->irq_delivered[irq]++;
 #endif
+		if(irq == ALARM && !core_alarm_due(core)) continue;
+
 		interrupt_handler* handler =  core->intvec[irq];
 		if(handler != NULL) handler();
 	
@@ -344,6 +492,9 @@ static inline void dispatch_interrupts(Core* core)
 
 /*
 	This is the signal handler for core threads, to handle interrupts.
+
+	If interrupts are disabled, the pending interrupts are left to
+	be dispatched by cpu_enable_interrupts().
  */
 static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 {
@@ -353,7 +504,10 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 	core->irq_count++;
 #endif
 
+	if(! intr_flag_exchange(0)) return;
+
 	dispatch_interrupts(core);
+	cpu_enable_interrupts();
 }
 
 
@@ -856,11 +1010,55 @@ void vm_configure(vm_config* vmc, interrupt_handler bootfunc, uint cores, uint s
 {
 	vmc->bootfunc = bootfunc;
 	vmc->cores = cores;
+	vmc->pin_host_cpus = 0;
+	vmc->host_fifo_priority = 0;
 	CHECK(vm_config_terminals(vmc, serialno, 0));
 }
 
 
 
+/*
+	Place a VM thread on the host, according to the configuration: pin it 
+	to host CPU cpu (unless cpu is negative) and raise it to SCHED_FIFO. 
+	The placement is reported, since it may fail (e.g., for lack of 
+	privileges); then, the thread just runs unplaced.
+ */
+static void place_host_thread(vm_config* vmc, pthread_t thread, const char* name, int cpu)
+{
+	if(! vmc->pin_host_cpus) cpu = -1;
+	if(cpu < 0 && vmc->host_fifo_priority <= 0) return;
+
+	fprintf(stderr, "vm: %-8s", name);
+
+	if(cpu >= CPU_SETSIZE) {
+		/* Out of range, leave the thread unpinned */
+		fprintf(stderr, " host cpu %d failed (out of range)", cpu);
+	}
+	else if(cpu >= 0) {
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(cpu, &cpuset);
+		int rc = pthread_setaffinity_np(thread, sizeof(cpuset), &cpuset);
+		if(rc==0)
+			fprintf(stderr, " host cpu %d", cpu);
+		else
+			fprintf(stderr, " host cpu %d failed (%s)", cpu, strerror(rc));
+	}
+
+	if(vmc->host_fifo_priority > 0) {
+		struct sched_param param = { .sched_priority = vmc->host_fifo_priority };
+		int rc = pthread_setschedparam(thread, SCHED_FIFO, &param);
+		if(rc==0)
+			fprintf(stderr, " SCHED_FIFO %d", vmc->host_fifo_priority);
+		else
+			fprintf(stderr, " SCHED_FIFO %d failed (%s)", vmc->host_fifo_priority, strerror(rc));
+	}
+
+	fprintf(stderr, "\n");
+}
+
+
+
 void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 {
 	vm_config VMC;
@@ -900,7 +1098,9 @@ void vm_run(vm_config* vmc)
 	pthread_barrier_init(& core_barrier, NULL, ncores);
 
 	/* Initialize the halted vector */
-	halt_vector = 0;
+	core_set_clear(& halt_vector);
+	core_set_clear(& park_vector);
+	waking_cores = 0;
 
 	/* Launch the core threads */
 	for(uint c=0; c < ncores; c++) {
@@ -927,8 +1127,17 @@ void vm_run(vm_config* vmc)
 		char thread_name[16];
 		CHECK(snprintf(thread_name,16,"core-%d",c));
 		CHECKRC(pthread_setname_np(CORE[c].thread, thread_name));
+		place_host_thread(vmc, CORE[c].thread, thread_name, vmc->host_cpu[c]);
 	}
 
+	/* Place the PIC thread, saving its placement to restore it at shutdown */
+	cpu_set_t saved_cpuset;
+	int saved_policy;
+	struct sched_param saved_param;
+	CHECKRC(pthread_getaffinity_np(PIC_thread, sizeof(saved_cpuset), &saved_cpuset));
+	CHECKRC(pthread_getschedparam(PIC_thread, &saved_policy, &saved_param));
+	place_host_thread(vmc, PIC_thread, "pic", vmc->pic_host_cpu);
+
 	/* Initialize PIC statistics */
 	PIC_loops = 0;
 
@@ -947,6 +1156,10 @@ void vm_run(vm_config* vmc)
 	/* Delete the Core table */
 	ncores = 0;
 
+	/* Restore the placement of the PIC thread */
+	CHECKRC(pthread_setaffinity_np(PIC_thread, sizeof(saved_cpuset), &saved_cpuset));
+	CHECKRC(pthread_setschedparam(PIC_thread, saved_policy, &saved_param));
+
 	/* Destroy the core barrier */
 	pthread_barrier_destroy(& system_barrier);
 	pthread_barrier_destroy(& core_barrier);
@@ -996,35 +1209,36 @@ uint cpu_cores()
 
 void cpu_core_halt()
 {
+	/* Interrupts arriving from now on are dispatched when we re-enable them */
+	intr_flag_exchange(0);
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
 
 	Core* core = curr_core();
-	uint32_t cmask = 1 << cpu_core_id;
 
 #if defined(CORE_STATISTICS)
 	TimerDuration stime0 = get_coarse_time();
 #endif
 
 	/* Set halt bit */
-	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_RELAXED);
+	core_set_add(& halt_vector, cpu_core_id);
 
 #if defined(CORE_STATISTICS)
 	core->hlt_count ++;
 #endif
 
-	siginfo_t info;
-
-	/* Sleep for 10 msec */
-	//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
-	//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-	int rc = sigwaitinfo(&sigusr1_set, &info);
-
-	if(rc>0) {
-		/* Got signal, dispatch */
-		dispatch_interrupts(core);
-	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+	/* 
+		Do not sleep if some interrupt was left pending by the USR1 handler,
+		or if we were restarted before we set the halt bit.
+	 */
+	if(! __atomic_exchange_n(& core->restart_token, 0, __ATOMIC_SEQ_CST) && ! core->intr_pending) {
+		siginfo_t info;
+
+		/* Sleep for 10 msec */
+		//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
+		//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
+		int rc = sigwaitinfo(&sigusr1_set, &info);
+		assert(rc>0 || (rc==-1 &&  (errno == EINTR || errno == EAGAIN)));
+		(void)rc;
 	}
 
 #if defined(CORE_STATISTICS)
@@ -1032,51 +1246,78 @@ void cpu_core_halt()
 	core->hlt_time += get_coarse_time()-stime0;
 #endif
 
-	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
+	/* If the halt bit was cleared, we were restarted */
+	if(! core_set_remove(& halt_vector, cpu_core_id))
+		__atomic_fetch_sub(& waking_cores, 1, __ATOMIC_RELAXED);
 
+	/* Unblock USR1 before dispatching: a handler may switch context */
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	cpu_enable_interrupts();
+}
+
+void cpu_core_park()
+{
+	core_set_add(& park_vector, cpu_core_id);
+	cpu_core_halt();
+	core_set_remove(& park_vector, cpu_core_id);
 }
 
-static int __core_restart(uint c)
+
+/*
+	Restart core c if it is halted. If sticky is set and the core is not
+	halted, its next halt will not sleep. This closes the race with a core
+	that is about to halt.
+ */
+static int __core_restart(uint c, int sticky)
 {
-	uint32_t cmask = 1 << c;
+	if(sticky)
+		__atomic_store_n(& CORE[c].restart_token, 1, __ATOMIC_SEQ_CST);
+
+	/* Count ourselves first, the core may leave the halt as soon as we clear its bit */
+	__atomic_fetch_add(& waking_cores, 1, __ATOMIC_RELAXED);
 
-	uint32_t prevhv = __atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
-	if( prevhv & cmask ) {
+	if( core_set_remove(& halt_vector, c) ) {
 		interrupt_core(CORE+c);
 #if defined(CORE_STATISTICS)		
 		__atomic_fetch_add(& CORE[c].rst_count, 1 , __ATOMIC_RELAXED);
 #endif
 
 		return 1;
-	} else 
+	} else {
+		__atomic_fetch_sub(& waking_cores, 1, __ATOMIC_RELAXED);
 		return 0;
+	}
 }
 
 
-void cpu_core_restart(uint c)
+int cpu_core_restart(uint c)
 {
-	__core_restart(c);
+	assert(c < ncores);
+	return __core_restart(c, 1);
 }
 
 
-void cpu_core_restart_one()
+int cpu_core_restart_one()
 {
-	/* Only restart if core_id < physical_cores */
-	uint32_t hv = halt_vector;
+	/* Coalesce: some core is already waking up */
+	if(__atomic_load_n(& waking_cores, __ATOMIC_RELAXED) > 0) 
+		return 0;
 
-	if( (hv=halt_vector)!=0 ) {
-		uint c = __builtin_ctz(hv);
-		if(c < physical_cores)
-			__core_restart(c);
-	}
+	uint halted;
+	int c = core_set_first(& halt_vector, & park_vector, &halted);
+	if(c < 0) return 0;
+
+	/* Only restart if there are fewer running cores than physical cores */
+	if(ncores - halted >= physical_cores)
+		return 0;
 
+	return __core_restart(c, 0);
 }
 
 void cpu_core_restart_all()
 {
 	for(uint c=0; c < ncores; c++)
-		__core_restart(c);
+		__core_restart(c, 1);
 }
 
 void cpu_core_barrier_sync()
@@ -1092,32 +1333,125 @@ void cpu_ici(uint core)
 
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, &curss));
+	int intr = cpu_disable_interrupts();
 	curr_core()->intvec[interrupt] = handler;
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &curss, NULL));
+	if(intr) cpu_enable_interrupts();
 }
 
 int cpu_interrupts_enabled()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, NULL, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return intr_enabled;
 }
 
 int cpu_disable_interrupts()
 {
-	sigset_t curss;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, & curss));
-	return sigismember(&curss, SIGUSR1)==0;
+	return intr_flag_exchange(0);
 }
 
 void cpu_enable_interrupts()
 {
-	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+	intr_flag_exchange(1);
+
+	/* 
+		Replay the interrupts that arrived while we were disabled. 
+		We may change core after a dispatch, so curr_core() must be
+		re-read each time.
+	 */
+	while(curr_core()->intr_pending) {
+		intr_flag_exchange(0);
+		dispatch_interrupts(curr_core());
+		intr_flag_exchange(1);
+	}
 }
 
 
+#if defined(BIOS_FAST_CONTEXT)
+
+/*
+	Fast context switching for x86-64.
+
+	A context switch is a function call: the caller-saved registers are
+	already saved by the caller, so we push the callee-saved registers 
+	(and the SSE/x87 control words) on the current stack, store the stack 
+	pointer, load the new stack pointer and pop the registers of the new
+	context. No system call is made (in particular, the signal mask is
+	not touched).
+
+	The frame of a switched-out context, from its saved stack pointer:
+
+	  mxcsr, x87 cw | r15 | r14 | r13 | r12 | rbx | rbp | return address
+ */
+void bios_switch_context(void** oldsp, void* newsp);
+void bios_context_start(void);
+
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".type bios_switch_context, @function\n"
+	"bios_switch_context:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size bios_switch_context, .-bios_switch_context\n"
+
+	/* A new context 'returns' here, with the function to call in rbx */
+	".p2align 4\n"
+	".type bios_context_start, @function\n"
+	"bios_context_start:\n"
+	"	callq *%rbx\n"
+	"	ud2\n"
+	".size bios_context_start, .-bios_context_start\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* The stack grows down from the (16-byte aligned) end of the stack segment */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	uint64_t* frame = (uint64_t*) (top - 80);
+
+	/* Inherit the SSE and x87 control words of the current context */
+	uint32_t csr[2];
+	__asm__ volatile("stmxcsr %0\n\tfnstcw %1" : "=m"(csr[0]), "=m"(csr[1]));
+
+	memcpy(&frame[0], csr, sizeof(csr));
+	frame[1] = 0;                                 /* r15 */
+	frame[2] = 0;                                 /* r14 */
+	frame[3] = 0;                                 /* r13 */
+	frame[4] = 0;                                 /* r12 */
+	frame[5] = (uint64_t)ctx_func;                /* rbx */
+	frame[6] = 0;                                 /* rbp */
+	frame[7] = (uint64_t)bios_context_start;      /* return address */
+
+	ctx->sp = frame;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	bios_switch_context(& oldctx->sp, newctx->sp);
+}
+
+#else
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -1129,8 +1463,8 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
   ctx->uc_stack.ss_size = ss_size;
   ctx->uc_stack.ss_flags = 0;
 
-  //CHECKRC(pthread_sigmask(0, NULL, & ctx->uc_sigmask));  /* We don't want any signals changed */
-  sigfillset( & ctx->uc_sigmask );
+  /* Interrupts are masked in software, USR1 stays unblocked */
+  ctx->uc_sigmask = core_signal_set;
   makecontext(ctx, (void*) ctx_func, 0);
 }
 
@@ -1140,6 +1474,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
@@ -1149,20 +1485,25 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 
 TimerDuration bios_set_timer(TimerDuration usec)
 {
-	time_t sec = usec / 1000000;
-	long nsec = (usec % 1000000) * 1000ull;
-	
-	struct itimerspec newtime = {
-		.it_value = {.tv_sec=sec, .tv_nsec=nsec},
-		.it_interval = {.tv_sec=0, .tv_nsec=0}
-	};
+	int intr = cpu_disable_interrupts();
+	Core* core = curr_core();
 
-	struct itimerspec oldtime;
-	
-	timer_settime(curr_core()->timer_id, 0, &newtime, &oldtime);
+	TimerDuration now = get_monotonic_time();
+	TimerDuration remaining = 0;
+	if(core->timer_deadline > now)
+		remaining = core->timer_deadline - now;
+
+	if(usec == 0) {
+		/* The timer is left armed; the ALARM will be dropped */
+		core->timer_deadline = 0;
+	} else {
+		core->timer_deadline = now + usec;
+		if(core->timer_armed == 0 || core->timer_deadline < core->timer_armed)
+			core_arm_timer(core, core->timer_deadline);
+	}
 
-	assert(oldtime.it_interval.tv_sec ==0 && oldtime.it_interval.tv_nsec==0);
-	return 1000000*oldtime.it_value.tv_sec + oldtime.it_value.tv_nsec/1000ull;
+	if(intr) cpu_enable_interrupts();
+	return remaining;
 }
 
 TimerDuration bios_cancel_timer()
@@ -2,7 +2,18 @@
 #define BIOS_H
 
 #include <stdint.h>
+#include <stddef.h>
+
+/*
+	On x86-64, contexts are switched by hand-written code that saves only
+	the callee-saved registers. Define BIOS_UCONTEXT to use the (much slower,
+	but portable) ucontext functions instead.
+ */
+#if defined(__x86_64__) && !defined(BIOS_UCONTEXT)
+#define BIOS_FAST_CONTEXT
+#else
 #include <ucontext.h>
+#endif
 
 /**
 	@file bios.h
@@ -129,7 +140,7 @@ typedef enum Interrupt
 
 
 /** @brief Maximum number of cores for a virtual machine. */
-#define MAX_CORES 32
+#define MAX_CORES 128
 
 /** @brief Maximum number of terminals for a virtual machine. */
 #define MAX_TERMINALS 4
@@ -198,6 +209,33 @@ typedef struct vm_config {
 		must be valid in this structure.
 	*/
 	int serial_out[MAX_TERMINALS];
+
+	/** @brief Flag that the VM threads are pinned to host CPUs.
+
+		If this is non-zero, the thread of core @c c is pinned to host CPU 
+		@c host_cpu[c], and the PIC thread (the thread calling @c vm_run()) 
+		is pinned to host CPU @c pic_host_cpu. A negative CPU leaves the 
+		thread unpinned. Pinning is best effort: if it fails, or the CPU is 
+		out of range, a warning is printed and the thread is left unpinned. 
+		Pinning the cores to distinct host CPUs avoids the latency hiccups 
+		of host-level migrations.
+	*/
+	int pin_host_cpus;
+
+	/** @brief The host CPU of each core, if @c pin_host_cpus is set. */
+	int host_cpu[MAX_CORES];
+
+	/** @brief The host CPU of the PIC thread, if @c pin_host_cpus is set. */
+	int pic_host_cpu;
+
+	/** @brief The host real-time priority of the VM threads.
+
+		If this is positive, the core threads and the PIC thread are run 
+		with the host's @c SCHED_FIFO policy, at this priority. This usually
+		needs privileges. Beware that a busy core then never yields its host
+		CPU to other threads on it, including the PIC thread.
+	*/
+	int host_fifo_priority;
 } vm_config;
 
 
@@ -233,6 +271,9 @@ int vm_config_terminals(vm_config* vmc, uint serialno, int nowait);
 	Note that this function will block until the terminal emulators
 	are executed.
 
+	The VM threads are not pinned to host CPUs and run with the default
+	host scheduling policy.
+
 	@param vmc the configuration to initialize
 	@param bootfunc the boot function to execute on cores
 	@param cores the number of cores
@@ -344,7 +385,8 @@ void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler);
 	If an interrupt arrives while interrupts are disabled, it will be
 	marked as _pending_ and will be raised when interrupts are re-enabled.
 
-	
+	Interrupts are disabled by clearing a flag of the core; this is cheap
+	and makes no system call.
 
 	@returns 1 if interrupts were enabled before the call, else 0.
 	@see cpu_enable_interrupts
@@ -382,33 +424,69 @@ void cpu_enable_interrupts();
 void cpu_core_halt();
 
 
+/**
+	@brief Park the core until it is restarted explicitly.
+
+	This is like @c cpu_core_halt(), except that the core is never picked
+	by @c cpu_core_restart_one(); it stays asleep until it is restarted by
+	@c cpu_core_restart() or @c cpu_core_restart_all(), or an interrupt 
+	arrives for it.
+
+	@see cpu_core_restart
+*/
+void cpu_core_park();
+
+
 /**
 	@brief Restart the given core.
 
-	This call will restart the given core, if it was halted.
+	This call will restart the given core, if it was halted. If the core
+	was not halted, its next call to @c cpu_core_halt() will return 
+	immediately; thus, a core that is about to halt will not miss the restart.
+
 	@param c the core to restart
+	@returns 1 if the core was halted, else 0
 */
-void cpu_core_restart(uint c);
+int cpu_core_restart(uint c);
 
 /**
 	@brief Restart some halted core.
 
 	This call will restart some halted core, if at least one exists.
+	Parked cores are not restarted.
+	To avoid flooding the cores with restarts, no core is restarted if 
+	some other core has been restarted and is still waking up, or if
+	there are at least as many running cores as there are physical
+	cpus on the host.
+
+	@returns 1 if a core was restarted, else 0
 */
-void cpu_core_restart_one();
+int cpu_core_restart_one();
 
 /**
 	@brief Signal all halted cores to restart.
 
 	When this function is called, all halted cores will be restarted. 
+	Cores which are not halted will not sleep at their next halt.
 */
 void cpu_core_restart_all();
 
 
+#if defined(BIOS_FAST_CONTEXT)
+/**
+	@brief A type for saving CPU context into.
+
+	The callee-saved registers of a thread are saved on its own stack, so 
+	the context is just the saved stack pointer. Unlike @c ucontext_t, the 
+	signal mask is not part of the context.
+*/
+typedef struct { void* sp; } cpu_context_t;
+#else
 /**
 	@brief A type for saving CPU context into.
 */
 typedef ucontext_t cpu_context_t;
+#endif
 
 
 /**
@@ -453,6 +531,10 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx);
 
 	If @c usec is specified as 0, any existing timer count is canceled.
 
+	The hardware timer is reprogrammed only when the new deadline is earlier
+	than the one it is armed for, so that calling this function frequently 
+	(e.g., on every context switch) is cheap.
+
 	@param usec the timer countdown interval in microseconds
 	@returns the time remaining interval since the last call
 	@see bios_cancel_timer
@@ -1,6 +1,7 @@
 
 
 #include <assert.h>
+#include <limits.h>
 
 #include "kernel_sched.h"
 #include "kernel_proc.h"
@@ -19,6 +20,19 @@
   */
 
 
+/* Wake up threads sleeping on an address (see the futex table) */
+static void futex_wake(void* addr, int n);
+
+
+/* Tell the cpu that we are spinning */
+static inline void cpu_relax()
+{
+#if defined(__x86__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#endif
+}
+
+
 /*
  	Pre-emption aware mutex.
  	-------------------------
@@ -29,6 +43,17 @@
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
 
+ 	The mutex word holds the owner (see MUTEX_OWNER). A thread that yields
+ 	waiting for the mutex marks it contended, and raises the MLFQ level 
+ 	of the owner to its own, so that the owner is not starved by threads 
+ 	of intermediate priority (priority inheritance). The owner gives back 
+ 	the priority inherited through a mutex when it unlocks it, but keeps 
+ 	what the waiters of the other contended mutexes it holds lent it.
+
+ 	Threads woken by a broadcast on a condition variable may also sleep 
+ 	waiting for the mutex (see Cond_Broadcast). Then, the owner finds 
+ 	MUTEX_QUEUED in the word, and wakes up the next one when it unlocks.
+
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
@@ -36,18 +61,25 @@ void Mutex_Lock(Mutex* lock)
 {
 #define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
+  Mutex self = (Mutex)cur_thread() | MUTEX_LOCKED;
+  Mutex word = MUTEX_INIT;
+
+  while(! __atomic_compare_exchange_n(lock, &word, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
     int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
-#if defined(__x86__) || defined(__x86_64__)
-      __builtin_ia32_pause();
-#endif
+    while((word = __atomic_load_n(lock, __ATOMIC_RELAXED))) {
+      cpu_relax();
       if(spin>0) 
       	spin--; 
       else { 
       	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
+      	if(cpu_interrupts_enabled()) {
+      		/* Lend our priority to the owner, before we give up the core */
+      		if(! (word & MUTEX_CONTENDED))
+      			__atomic_compare_exchange_n(lock, &word, word | MUTEX_CONTENDED, 0, 
+      				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+      		sched_inherit_priority(lock);
       		yield(SCHED_MUTEX); 
+      	}
       }
     }
   }
@@ -55,9 +87,343 @@ void Mutex_Lock(Mutex* lock)
 }
 
 
+int Mutex_TryLock(Mutex* lock)
+{
+  Mutex word = MUTEX_INIT;
+  return __atomic_compare_exchange_n(lock, &word, (Mutex)cur_thread() | MUTEX_LOCKED, 0, 
+    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+  Mutex word = __atomic_exchange_n(lock, MUTEX_INIT, __ATOMIC_RELEASE);
+
+  /* Give back the priority inherited from the waiters */
+  if(word & MUTEX_CONTENDED)
+    sched_release_priority(lock);
+
+  /* Pass the mutex on to a thread moved here by Cond_Broadcast */
+  if(word & MUTEX_QUEUED)
+    futex_wake(lock, 1);
+}
+
+
+/*
+ 	Sleeping mutex.
+ 	---------------
+
+ 	The word of a SleepMutex is 0 when unlocked, 1 when locked, and 2 when
+ 	locked and some thread may be sleeping on it. Lock and unlock are 
+ 	a single atomic operation, unless the word is 2. 
+
+ 	Sleeping threads wait in a futex table, hashed by the address of the 
+ 	word, so that a SleepMutex needs no other storage. A thread sleeps only
+ 	if the word is still 2 under the lock of the bucket, and an unlocker 
+ 	clears the word before it takes the lock of the bucket to wake up a 
+ 	thread, so no wakeup is lost.
+
+ 	The lock of a bucket is always held with preemption off. Cond_Broadcast
+ 	moves waiters to the table even from interrupt handlers, and these must
+ 	never spin on a lock held by the thread they interrupted.
+ */
+
+/* Number of buckets in the futex table (a power of 2) */
+#define FUTEX_BUCKETS 64
+
+/** \cond HELPER Helper structures for sleeping mutexes. */
+typedef struct __futex_waiter {
+	struct __futex_waiter* next;	/* the next waiter of the bucket */
+	void* addr;					/* the word waited on */
+	TCB* thread;				/* thread to wait */
+	sig_atomic_t removed;		/* this is set if the waiter is woken up 
+								   and removed from the bucket */
+} __futex_waiter;
+
+typedef struct __futex_bucket {
+	Mutex lock;					/* protects the list */
+	__futex_waiter* waiters;	/* the waiters, in FIFO order */
+} __futex_bucket;
+/** \endcond */
+
+static __futex_bucket futex_table[FUTEX_BUCKETS];
+
+static inline __futex_bucket* futex_bucket(void* addr)
+{
+	uintptr_t a = (uintptr_t) addr;
+	return & futex_table[((a >> 2) ^ (a >> 10)) & (FUTEX_BUCKETS-1)];
+}
+
+/* Lock a bucket, returning the previous preemption state */
+static inline int futex_lock(__futex_bucket* bucket)
+{
+	int preempt = preempt_off;
+	Mutex_Lock(& bucket->lock);
+	return preempt;
+}
+
+static inline void futex_unlock(__futex_bucket* bucket, int preempt)
+{
+	Mutex_Unlock(& bucket->lock);
+	if(preempt) preempt_on;
+}
+
+/* Add a waiter, whose thread is asleep, to the waiters of its address */
+static void futex_enqueue(__futex_waiter* waiter)
+{
+	__futex_bucket* bucket = futex_bucket(waiter->addr);
+	__futex_waiter** pw;
+
+	int preempt = futex_lock(bucket);
+	for(pw = & bucket->waiters; *pw != NULL; pw = & (*pw)->next);
+	waiter->next = NULL;
+	*pw = waiter;
+	futex_unlock(bucket, preempt);
+}
+
+/* Remove a waiter that woke up, unless futex_wake removed it */
+static void futex_dequeue(__futex_waiter* waiter)
+{
+	__futex_bucket* bucket = futex_bucket(waiter->addr);
+	__futex_waiter** pw;
+
+	int preempt = futex_lock(bucket);
+	if(! waiter->removed) {
+		for(pw = & bucket->waiters; *pw != waiter; pw = & (*pw)->next);
+		*pw = waiter->next;
+		waiter->removed = 1;
+	}
+	futex_unlock(bucket, preempt);
+}
+
+/* Return 1 if some thread is queued on addr */
+static int futex_queued(void* addr)
+{
+	__futex_bucket* bucket = futex_bucket(addr);
+	__futex_waiter* w;
+
+	int preempt = futex_lock(bucket);
+	for(w = bucket->waiters; w != NULL && w->addr != addr; w = w->next);
+	futex_unlock(bucket, preempt);
+	return w != NULL;
+}
+
+/* Sleep, if *addr == val */
+static void futex_wait(unsigned int* addr, unsigned int val)
+{
+	__futex_bucket* bucket = futex_bucket(addr);
+	__futex_waiter waiter = { .next = NULL, .addr = addr, .thread = cur_thread(), .removed = 0 };
+	__futex_waiter** pw;
+
+	int preempt = futex_lock(bucket);
+	if(__atomic_load_n(addr, __ATOMIC_SEQ_CST) != val) {
+		futex_unlock(bucket, preempt);
+		return;
+	}
+
+	for(pw = & bucket->waiters; *pw != NULL; pw = & (*pw)->next);
+	*pw = &waiter;
+	sleep_releasing(STOPPED, & bucket->lock, SCHED_FUTEX, NO_TIMEOUT);
+	if(preempt) preempt_on;
+
+	/* Woke up, if we were not woken by futex_wake, we must remove ourselves */
+	futex_dequeue(&waiter);
+}
+
+/* Wake up (at most) n threads sleeping on addr */
+static void futex_wake(void* addr, int n)
+{
+	__futex_bucket* bucket = futex_bucket(addr);
+	__futex_waiter** pw = & bucket->waiters;
+
+	int preempt = futex_lock(bucket);
+	while(*pw != NULL) {
+		__futex_waiter* waiter = *pw;
+		if(waiter->addr != addr) {
+			pw = & waiter->next;
+			continue;
+		}
+		*pw = waiter->next;
+		waiter->removed = 1;
+		if(wakeup(waiter->thread) && --n == 0)
+			break;
+	}
+	futex_unlock(bucket, preempt);
+}
+
+
+void SleepMutex_Lock(SleepMutex* lock)
+{
+#define SLEEPMUTEX_SPINS (cpu_cores()>1 ? 100 : 0)
+
+  unsigned int word = 0;
+  if(__atomic_compare_exchange_n(lock, &word, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+
+  /* The owner may be about to unlock, if it runs on another core */
+  for(int spin = SLEEPMUTEX_SPINS; spin > 0 && word == 1; spin--) {
+    cpu_relax();
+    word = 0;
+    if(__atomic_compare_exchange_n(lock, &word, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return;
+  }
+
+  /* Mark the mutex contended, and sleep until we get it */
+  if(word != 2)
+    word = __atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE);
+  while(word != 0) {
+    futex_wait(lock, 2);
+    word = __atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE);
+  }
+#undef SLEEPMUTEX_SPINS
+}
+
+
+int SleepMutex_TryLock(SleepMutex* lock)
+{
+  unsigned int word = 0;
+  return __atomic_compare_exchange_n(lock, &word, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+void SleepMutex_Unlock(SleepMutex* lock)
+{
+  if(__atomic_exchange_n(lock, 0, __ATOMIC_RELEASE) == 2)
+    futex_wake(lock, 1);
+}
+
+
+/*
+ 	Reader-writer lock.
+ 	-------------------
+
+ 	The state word holds the number of readers in the low bits, the number 
+ 	of writers waiting for the lock above them, and RW_WRITER when a writer
+ 	holds the lock. A reader takes the lock with a single CAS, if there is 
+ 	no writer, holding or waiting (writers are preferred).
+
+ 	Threads that cannot take the lock count themselves in @c sleepers and 
+ 	sleep on @c epoch. Whoever releases the lock, if there are sleepers,
+ 	bumps @c epoch and wakes them all up, to try again. A thread only 
+ 	sleeps if @c epoch has not changed since before it found the lock busy,
+ 	so no wakeup is lost.
+ */
+#define RW_READER 1u
+#define RW_READERS 0xffffu
+#define RW_WAITER (1u << 16)
+#define RW_WAITERS (0x7fffu << 16)
+#define RW_WRITER (1u << 31)
+
+static void rw_sleep(RWLock* rw, unsigned int busy)
+{
+  __atomic_fetch_add(&rw->sleepers, 1, __ATOMIC_SEQ_CST);
+  unsigned int epoch = __atomic_load_n(&rw->epoch, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&rw->state, __ATOMIC_SEQ_CST) & busy)
+    futex_wait(&rw->epoch, epoch);
+  __atomic_fetch_sub(&rw->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void rw_wake(RWLock* rw)
+{
+  if(__atomic_load_n(&rw->sleepers, __ATOMIC_SEQ_CST) > 0) {
+    __atomic_fetch_add(&rw->epoch, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&rw->epoch, INT_MAX);
+  }
+}
+
+
+void RW_ReadLock(RWLock* rw)
+{
+  unsigned int state = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+  while(1) {
+    if(! (state & (RW_WRITER|RW_WAITERS))) {
+      if(__atomic_compare_exchange_n(&rw->state, &state, state + RW_READER, 0, 
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    }
+    else {
+      rw_sleep(rw, RW_WRITER|RW_WAITERS);
+      state = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+
+void RW_ReadUnlock(RWLock* rw)
+{
+  unsigned int state = __atomic_sub_fetch(&rw->state, RW_READER, __ATOMIC_SEQ_CST);
+
+  /* The last reader lets a waiting writer in */
+  if((state & RW_READERS) == 0 && (state & RW_WAITERS))
+    rw_wake(rw);
+}
+
+
+void RW_WriteLock(RWLock* rw)
+{
+  /* From now on, no new readers get in */
+  unsigned int state = __atomic_add_fetch(&rw->state, RW_WAITER, __ATOMIC_RELAXED);
+  while(1) {
+    if(! (state & (RW_WRITER|RW_READERS))) {
+      if(__atomic_compare_exchange_n(&rw->state, &state, state - RW_WAITER + RW_WRITER, 0, 
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    }
+    else {
+      rw_sleep(rw, RW_WRITER|RW_READERS);
+      state = __atomic_load_n(&rw->state, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+
+void RW_WriteUnlock(RWLock* rw)
+{
+  __atomic_fetch_sub(&rw->state, RW_WRITER, __ATOMIC_SEQ_CST);
+  rw_wake(rw);
+}
+
+
+/*
+ 	Ticket spinlock.
+ 	----------------
+
+ 	A test-and-set lock makes all waiting cores write the same word, and
+ 	the core that gets it is arbitrary. Here, each core takes a ticket 
+ 	with a single atomic increment, and then only reads @c serving, which
+ 	changes once per unlock. A core with k cores ahead of it is not 
+ 	served for at least k critical sections, so it pauses for a time 
+ 	proportional to k between reads.
+ */
+
+/* The number of pause instructions per waiting core ahead of us */
+#define SPINLOCK_BACKOFF 32
+
+void Spinlock_Lock(Spinlock* lock)
+{
+  unsigned int ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+  unsigned int serving;
+
+  while((serving = __atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE)) != ticket) {
+    for(unsigned int i = (ticket - serving) * SPINLOCK_BACKOFF; i > 0; i--)
+      cpu_relax();
+  }
+}
+
+
+int Spinlock_TryLock(Spinlock* lock)
+{
+  /* The lock is free iff the next ticket is served right away */
+  unsigned int serving = __atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE);
+  return __atomic_compare_exchange_n(&lock->next, &serving, serving+1, 0, 
+    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+void Spinlock_Unlock(Spinlock* lock)
+{
+  /* Only the holder writes serving */
+  __atomic_store_n(&lock->serving, lock->serving+1, __ATOMIC_RELEASE);
 }
 
 
@@ -70,9 +436,15 @@ void Mutex_Unlock(Mutex* lock)
 typedef struct __cv_waiter {
 	rlnode node;				/* become part of a ring */
 	TCB* thread;				/* thread to wait */
+	Mutex* mutex;				/* the mutex to lock again */
+	__futex_waiter morph;		/* used to wait for the mutex, after a broadcast */
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	sig_atomic_t morphed;		/* this is set if the waiter is moved to 
+								   the waiters of the mutex */
+	sig_atomic_t chained;		/* this is set if other waiters of the same
+								   broadcast may wait for the mutex */
 } __cv_waiter;
 /** \endcond */
 
@@ -121,7 +493,8 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 static int cv_wait(Mutex* mutex, CondVar* cv, 
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=cur_thread(), .mutex = mutex, 
+		.signalled = 0, .removed=0, .morphed = 0, .chained = 0 };
 	rlnode_init(& waiter.node, &waiter);
 
 	Mutex_Lock(&(cv->waitset_lock));
@@ -147,7 +520,16 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	}
 	Mutex_Unlock(&(cv->waitset_lock));
 
+	/* If we woke up early (e.g., by timeout), stop waiting for the mutex */
+	if(waiter.morphed)
+		futex_dequeue(& waiter.morph);
+
 	Mutex_Lock(mutex);
+
+	/* Make sure the rest of the broadcast waiters will get the mutex */
+	if(waiter.chained && futex_queued(mutex))
+		__atomic_fetch_or(mutex, MUTEX_QUEUED, __ATOMIC_RELAXED);
+
 	return waiter.signalled;
 }
 
@@ -155,23 +537,67 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 /**
   @internal
   Helper for Cond_Signal and Cond_Broadcast. This method 
-  will actually find a waiter to signal, if one exists. 
+  will actually find a waiter to signal (using the given
+  wakeup function), if one exists. 
   Else, it leaves the cv->waitset == NULL.
  */
-static inline void cv_signal(CondVar* cv)
+static inline void cv_signal_with(CondVar* cv, int (*wake)(TCB*))
 {
 	/* Wakeup first process in the waiters' queue, if it exists. */
 	while(cv->waitset) {
 		__cv_waiter* waiter = cv->waitset;
 		remove_from_ring(cv, waiter);
 		waiter->removed = 1;
-		if(wakeup(waiter->thread)) {
+		if(wake(waiter->thread)) {
 			waiter->signalled = 1;
 			return;
 		}
 	}
 }
 
+static inline void cv_signal(CondVar* cv)
+{
+	cv_signal_with(cv, wakeup);
+}
+
+/**
+  @internal
+  Helper for Cond_Broadcast, with wait morphing. 
+
+  Only the first waiter is woken up (using the given wakeup function). 
+  The other waiters of the same mutex are moved, still asleep, to 
+  the waiters of the mutex; they would only contend for the mutex that 
+  the first waiter is about to lock. When a waiter of the broadcast 
+  locks the mutex and finds others queued, it marks the mutex with 
+  MUTEX_QUEUED, so that they are woken up one at a time, by 
+  Mutex_Unlock.
+ */
+static void cv_broadcast_with(CondVar* cv, int (*wake)(TCB*))
+{
+	__cv_waiter* first = NULL;
+
+	while(cv->waitset) {
+		__cv_waiter* waiter = cv->waitset;
+		remove_from_ring(cv, waiter);
+		waiter->removed = 1;
+
+		if(first != NULL && waiter->mutex == first->mutex) {
+			/* The waiter is asleep, or it will notice that it is morphed */
+			waiter->morph = (__futex_waiter){ .addr = waiter->mutex, 
+				.thread = waiter->thread, .removed = 0 };
+			futex_enqueue(& waiter->morph);
+			waiter->morphed = 1;
+			waiter->chained = 1;
+			waiter->signalled = 1;
+			first->chained = 1;
+		}
+		else if(wake(waiter->thread)) {
+			waiter->signalled = 1;
+			if(first == NULL) first = waiter;
+		}
+	}
+}
+
 
 
 int Cond_Wait(Mutex* mutex, CondVar* cv)
@@ -197,7 +623,7 @@ void Cond_Signal(CondVar* cv)
 void Cond_Broadcast(CondVar* cv)
 {
   Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
+  cv_broadcast_with(cv, wakeup);
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
@@ -207,65 +633,19 @@ void Cond_Broadcast(CondVar* cv)
 
 /*
  *
- * The kernel locks
+ * Kernel waiting 
  *
  */
 
-/**
- * @brief The kernel lock.
- *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has advantages over a simple mutex. 
- * The main advantage is that @c kernel_mutex is held for a very short time
- * regardless of contention. Thus, in multicore machines, it allows for cores
- * to be passed to other threads. 
- * 
+/*
+	There is no global kernel lock. Each kernel object is protected by its 
+	own mutex (see the lock order in kernel_cc.h), and a system call waits 
+	releasing just the mutex of the object it waits on.
  */
-
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
-
-/* Semaphore counter */
-static int kernel_sem = 1;
-
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
-
-void kernel_lock()
-{
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
-}
-
-void kernel_unlock()
-{
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
-}
-
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan_name, TimerDuration timeout)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
-
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
-
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
-
-	return ret;
+	return cv_wait(mx, cv, cause, timeout);
 }
 
 void kernel_signal(CondVar* cv) 
@@ -278,14 +658,22 @@ void kernel_broadcast(CondVar* cv)
 	Cond_Broadcast(cv); 
 }
 
-void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
-{
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+void kernel_signal_handoff(CondVar* cv) 
+{ 
+	Mutex_Lock(&(cv->waitset_lock));
+	cv_signal_with(cv, wakeup_handoff);
+	Mutex_Unlock(&(cv->waitset_lock));
 }
 
+void kernel_broadcast_handoff(CondVar* cv) 
+{ 
+	Mutex_Lock(&(cv->waitset_lock));
+	/* Only the first waiter is handed the core, the rest wait for the mutex */
+	cv_broadcast_with(cv, wakeup_handoff);
+	Mutex_Unlock(&(cv->waitset_lock));
+}
+
+
 
 
 
@@ -32,32 +32,102 @@
 
 
 
-/*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
+/**
+	@brief Try to lock a mutex without waiting.
+
+	This is used in the non-preemptive domain, when waiting for the
+	mutex could lead to a deadlock (e.g., when a second scheduler lock 
+	is needed).
+
+	@returns 1 if the mutex was locked, 0 otherwise
  */
+int Mutex_TryLock(Mutex* lock);
+
 
 /**
-	@brief Lock the kernel.
+	@brief Lock a spinlock.
+
+	The caller spins until its ticket is served. While it waits, it 
+	backs off in proportion to the number of cores ahead of it in the 
+	queue, so that waiting cores do not keep the lock busy.
+	Preemption must be off.
  */
-void kernel_lock();
+void Spinlock_Lock(Spinlock* lock);
 
 /**
-	@brief Unlock the kernel.
+	@brief Try to lock a spinlock without waiting.
+
+	@returns 1 if the spinlock was locked, 0 otherwise
  */
-void kernel_unlock();
+int Spinlock_TryLock(Spinlock* lock);
 
 /**
-	@brief Wait on a condition variable using the kernel lock.
+	@brief Unlock a spinlock.
+
+	This may be called by a different thread than the one that locked
+	the spinlock (e.g., across a context switch).
+ */
+void Spinlock_Unlock(Spinlock* lock);
+
+
+/**
+	@brief The word of a locked mutex.
+
+	A locked mutex holds a pointer to the TCB of its owner (which is NULL 
+	before the scheduler starts), together with the following flags, in 
+	the low bits of the word (a TCB is aligned on at least 8 bytes).
+ */
+#define MUTEX_LOCKED 1
+
+/** @brief Flag set in the word of a locked mutex, when some thread yielded waiting for it. */
+#define MUTEX_CONTENDED 2
+
+/** @brief Flag set in the word of a locked mutex, when threads sleep waiting for it. 
+	@see Cond_Broadcast
+ */
+#define MUTEX_QUEUED 4
+
+/** @brief The owner of a locked mutex, given the mutex word. */
+#define MUTEX_OWNER(word) ((TCB*)((word) & ~(uintptr_t)(MUTEX_LOCKED|MUTEX_CONTENDED|MUTEX_QUEUED)))
+
+
+/*
+ * Kernel locking.
+ */
+
+/**
+	@brief Wait on a condition variable, releasing the lock of a kernel object.
+
+	There is no global kernel lock: each kernel object is protected by a 
+	mutex of its own, and system calls lock only the objects they use.
+	When more than one lock is held, they must be taken in the following
+	order (outermost first):
+
+	1. the process table lock (@c proc_table_lock in kernel_proc.c),
+	2. the lock of a PCB (@c PCB::lock),
+	3. the port map lock (@c port_map_lock in kernel_socket.c),
+	4. the lock of a socket control block,
+	5. the lock of a pipe control block,
+	6. the FCB table lock (@c fcb_table_lock in kernel_streams.c),
+
+	followed by the scheduler locks (condition variable wait sets, core 
+	run queues). These are innermost: they may be taken while any of the 
+	above is held, but none of the above may be taken while a scheduler 
+	lock is held.
+	In particular, @c Close and the other stream operations are never 
+	called with the FCB table lock or a PCB lock held.
+
+	@param mx the (locked) mutex of the object waited on; it is released
+	   while waiting and locked again before returning
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
 
 /**
 	@brief Signal a kernel condition to one waiter.
@@ -71,15 +141,24 @@ void kernel_signal(CondVar* cv);
   */
 void kernel_broadcast(CondVar* cv);
 
-
 /**
-	@brief Put thread to sleep, unlocking the kernel.
+	@brief Signal a kernel condition to one waiter, handing off the core.
+
+	The woken thread is moved to the current core, and runs as soon as the
+	current thread blocks. Use this only when the caller is about to wait 
+	for the woken thread (e.g., a pipe writer that filled the buffer); 
+	else, the woken thread waits until another core steals it.
 
-	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
+	@see wakeup_handoff
   */
-void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
+void kernel_signal_handoff(CondVar* cv);
 
+/**
+	@brief Signal a kernel condition to all waiters, handing off the core to the first.
+
+	@see kernel_signal_handoff
+  */
+void kernel_broadcast_handoff(CondVar* cv);
 
 
 /** @brief Set the preemption status for the current core.
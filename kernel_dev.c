@@ -103,6 +103,7 @@ int serial_read(void* dev, char *buf, unsigned int size)
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->spinlock);
 
   uint count =  0;
 
@@ -113,12 +114,13 @@ int serial_read(void* dev, char *buf, unsigned int size)
       count++;
     }
     else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+      kernel_wait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO);
     }
     else
       break;
   }
 
+  Mutex_Unlock(&dcb->spinlock);
   preempt_on;           /* Restart preemption */
 
   return count;
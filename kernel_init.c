@@ -26,6 +26,7 @@ static struct {
   Task init_task;
   int argl;
   void* args;
+  sched_policy policy;
 } boot_rec;
 
 
@@ -38,7 +39,7 @@ void boot_tinyos_kernel()
     initialize_processes();
     initialize_devices();
     initialize_files();
-    initialize_scheduler();
+    initialize_scheduler(boot_rec.policy);
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
@@ -60,10 +61,18 @@ void boot_tinyos_kernel()
 
 
 void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
+{
+  boot_with_policy(ncores, nterm, SCHED_POLICY_MLFQ, boot_task, argl, args);
+}
+
+
+void boot_with_policy(uint ncores, uint nterm, sched_policy policy, 
+  Task boot_task, int argl, void* args)
 {
   boot_rec.init_task = boot_task;
   boot_rec.argl = argl;
   boot_rec.args = args;
+  boot_rec.policy = policy;
 
   vm_boot(boot_tinyos_kernel, ncores, nterm);
 }
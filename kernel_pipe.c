@@ -39,7 +39,8 @@ int checkRemaining(int *w_position, int *r_position)
 		return (*r_position - *w_position -1);
 	if(*w_position > *r_position)
 		return (PIPE_BUFFER_SIZE - (*w_position - *r_position +1));
-	return PIPE_BUFFER_SIZE;
+	/* equal positions hold one element, unless the queue is empty */
+	return checkEmpty(r_position) ? PIPE_BUFFER_SIZE : PIPE_BUFFER_SIZE - 1;
 
 }
 
@@ -80,6 +81,7 @@ pipe_cb* init_Pipe(){
 
    /*initializing the fields of the pipe_cb, firstly the condition variable
     *and then the read and write position are set to -1 */
+	pipe->lock = MUTEX_INIT;
 	pipe->has_space = COND_INIT;
 	pipe->has_data = COND_INIT;
 	
@@ -127,15 +129,24 @@ int pipe_write(void* pipecb_t, const char *buf, unsigned int n)
 
 	/* checking if the pipe_cb is null, if the numbe of bytes we wanna write is below 1,
 	* if the writer_end is null or if the reader_end is null, if any of them are true return -1 */
-	if(pipecb == NULL || n < 1 || pipecb->writer == NULL || pipecb->reader == NULL)
+	if(pipecb == NULL || n < 1)
 		return -1;
 
+	Mutex_Lock(&pipecb->lock);
+
+	if(pipecb->writer == NULL || pipecb->reader == NULL) {
+		Mutex_Unlock(&pipecb->lock);
+		return -1;
+	}
+
 	/* while the buffer is full and the reader is not null (closed) then wait */
 	while(checkFull(&pipecb->w_position, &pipecb->r_position) && pipecb->reader != NULL)
-    	kernel_wait(&pipecb->has_space, SCHED_PIPE);
+    	kernel_wait(&pipecb->lock, &pipecb->has_space, SCHED_PIPE);
 
-	if(pipecb->reader == NULL)
+	if(pipecb->reader == NULL) {
+		Mutex_Unlock(&pipecb->lock);
 		return -1;
+	}
 
 	/* We are ready to write*/
 
@@ -147,8 +158,13 @@ int pipe_write(void* pipecb_t, const char *buf, unsigned int n)
 	for(int i = 0; i < elementsToWrite; i++)
 		enQueue(buf[i], pipecb->BUFFER, &pipecb->w_position, &pipecb->r_position);
 	
-	/* singals all the waiters */
-	kernel_broadcast(&pipecb->has_data);
+	/* singals all the waiters, if the buffer is full we will block on the 
+	 * next write, so the reader can have our core */
+	if(checkFull(&pipecb->w_position, &pipecb->r_position))
+		kernel_broadcast_handoff(&pipecb->has_data);
+	else
+		kernel_broadcast(&pipecb->has_data);
+	Mutex_Unlock(&pipecb->lock);
 
 	return elementsToWrite;
 }
@@ -159,22 +175,28 @@ int pipe_read(void* pipecb_t, char *buf, unsigned int n)
 
 	/* if pipe_cb is null or if the number we want to read is below 1 or the reader_end
 	 * is null (closed) then return -1 */
-	if(pipecb == NULL || n < 1 || pipecb->reader == NULL)
+	if(pipecb == NULL || n < 1)
 		return -1;
 
-	/* if writer_end is null (closed) so there will be not written any new characters to read and
-	 * the remaining postions are equal to PIPE_BUFFER_SIZE then it is EOF (End Of File) and we return 0*/
-	if(pipecb->writer == NULL && (checkRemaining(&pipecb->w_position, &pipecb->r_position) == PIPE_BUFFER_SIZE))
-		return 0;
+	Mutex_Lock(&pipecb->lock);
+
+	if(pipecb->reader == NULL) {
+		Mutex_Unlock(&pipecb->lock);
+		return -1;
+	}
 
 	/* while the buffer is empty and the writer is not null (closed) then wait */
 	while(checkEmpty(&pipecb->r_position) && pipecb->writer!=NULL)
-    	kernel_wait(&pipecb->has_data, SCHED_PIPE);
+    	kernel_wait(&pipecb->lock, &pipecb->has_data, SCHED_PIPE);
 
 	/* We are ready to read*/
 
-	if(pipecb->writer == NULL && (checkEmpty(&pipecb->r_position)))
+	/* if writer_end is null (closed) so there will be not written any new characters to read and
+	 * the buffer is empty then it is EOF (End Of File) and we return 0*/
+	if(pipecb->writer == NULL && (checkEmpty(&pipecb->r_position))) {
+		Mutex_Unlock(&pipecb->lock);
 		return 0;
+	}
 
 	/* Check how many chars we can write*/
 	int remainingData = PIPE_BUFFER_SIZE - checkRemaining(&pipecb->w_position, &pipecb->r_position);
@@ -184,8 +206,13 @@ int pipe_read(void* pipecb_t, char *buf, unsigned int n)
 	for(int i = 0; i < elementsToRead; i++)
 		buf[i] = deQueue(pipecb->BUFFER, &pipecb->w_position, &pipecb->r_position);
 	
-	/* singals all the waiters */
-	kernel_broadcast(&pipecb->has_space);
+	/* singals all the waiters, if the buffer is empty we will block on the 
+	 * next read, so the writer can have our core */
+	if(checkEmpty(&pipecb->r_position))
+		kernel_broadcast_handoff(&pipecb->has_space);
+	else
+		kernel_broadcast(&pipecb->has_space);
+	Mutex_Unlock(&pipecb->lock);
 
 	return elementsToRead;
 }
@@ -195,14 +222,21 @@ int pipe_writer_close(void* pipecb_t)
 	pipe_cb* pipecb = (pipe_cb*) pipecb_t;
 
 	/* if pipecb is null or writer is already null then return -1*/
-	if(pipecb == NULL || pipecb->writer == NULL)
+	if(pipecb == NULL)
+		return -1;
+
+	Mutex_Lock(&pipecb->lock);
+	if(pipecb->writer == NULL) {
+		Mutex_Unlock(&pipecb->lock);
 		return -1;
+	}
 
 	/* closing the writer, making it null*/
 	pipecb->writer = NULL;
 
 	/* signals all the waiters*/
 	kernel_broadcast(&pipecb->has_data);
+	Mutex_Unlock(&pipecb->lock);
 
 	return 0;
 }
@@ -212,14 +246,21 @@ int pipe_reader_close(void* pipecb_t)
 	pipe_cb* pipecb = (pipe_cb*) pipecb_t;
 
 	/* if pipecb is null or reader is already null then return -1*/
-	if(pipecb == NULL || pipecb->reader == NULL)
+	if(pipecb == NULL)
 		return -1;
 
+	Mutex_Lock(&pipecb->lock);
+	if(pipecb->reader == NULL) {
+		Mutex_Unlock(&pipecb->lock);
+		return -1;
+	}
+
 	/* closing the reader, making it null*/
 	pipecb->reader = NULL;
 
 	/* signals all the waiters*/
 	kernel_broadcast(&pipecb->has_space);
+	Mutex_Unlock(&pipecb->lock);
 
 	return 0;
 }
@@ -19,6 +19,9 @@
 PCB PT[MAX_PROC];
 unsigned int process_count;
 
+/* Protects the process table and the relations between processes */
+Mutex proc_table_lock = MUTEX_INIT;
+
 PCB* get_pcb(Pid_t pid)
 {
   return PT[pid].pstate==FREE ? NULL : &PT[pid];
@@ -48,6 +51,8 @@ static inline void initialize_PCB(PCB* pcb)
   //also initializing ptcb list
   rlnode_init(& pcb->ptcb_list, NULL);
   pcb->thread_count = 0;
+  pcb->nice = 0;
+  pcb->lock = MUTEX_INIT;
 }
 
 
@@ -78,7 +83,7 @@ void initialize_processes()
 
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_table_lock held
 */
 PCB* acquire_PCB()
 {
@@ -88,6 +93,7 @@ PCB* acquire_PCB()
     pcb = pcb_freelist;
     pcb->pstate = ALIVE;
     pcb_freelist = pcb_freelist->parent;
+    pcb->parent = NULL;
     process_count++;
   }
 
@@ -95,7 +101,7 @@ PCB* acquire_PCB()
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_table_lock held
 */
 void release_PCB(PCB* pcb)
 {
@@ -135,16 +141,31 @@ void start_main_thread()
 Pid_t sys_Exec(Task call, int argl, void* args)
 {
   PCB *curproc, *newproc;
-  
+
+  /* Copy the arguments to new storage, owned by the new process */
+  void* newargs = NULL;
+  if(args!=NULL) {
+    newargs = malloc(argl);
+    memcpy(newargs, args, argl);
+  }
+
+  Mutex_Lock(& proc_table_lock);
+
   /* The new process PCB */
   newproc = acquire_PCB();
 
-  if(newproc == NULL) goto finish;  /* We have run out of PIDs! */
+  if(newproc == NULL) {
+    /* We have run out of PIDs! */
+    Mutex_Unlock(& proc_table_lock);
+    free(newargs);
+    goto finish;
+  }
 
   if(get_pid(newproc)<=1) {
     /* Processes with pid<=1 (the scheduler and the init process) 
        are parentless and are treated specially. */
     newproc->parent = NULL;
+    newproc->nice = 0;
   }
   else
   {
@@ -155,26 +176,26 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     newproc->parent = curproc;
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
+    /* Inherit the nice value */
+    newproc->nice = curproc->nice;
+
     /* Inherit file streams from parent */
+    Mutex_Lock(& curproc->lock);
     for(int i=0; i<MAX_FILEID; i++) {
        newproc->FIDT[i] = curproc->FIDT[i];
        if(newproc->FIDT[i])
           FCB_incref(newproc->FIDT[i]);
     }
+    Mutex_Unlock(& curproc->lock);
   }
 
 
   /* Set the main thread's function */
   newproc->main_task = call;
-
-  /* Copy the arguments to new storage, owned by the new process */
   newproc->argl = argl;
-  if(args!=NULL) {
-    newproc->args = malloc(argl);
-    memcpy(newproc->args, args, argl);
-  }
-  else
-    newproc->args=NULL;
+  newproc->args = newargs;
+
+  Mutex_Unlock(& proc_table_lock);
 
   /* 
     Create and wake up the thread for the main function. This must be the last thing
@@ -196,8 +217,10 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     new_ptcb->exit_cv = COND_INIT;
     new_ptcb->refcount = 0;
     rlnode_init(&new_ptcb->ptcb_list_node, new_ptcb);
+    Mutex_Lock(& newproc->lock);
     rlist_push_back(&newproc->ptcb_list, &new_ptcb->ptcb_list_node);
     newproc->thread_count++;
+    Mutex_Unlock(& newproc->lock);
 
     wakeup(newproc->main_thread);
   }
@@ -217,7 +240,57 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  Mutex_Lock(& proc_table_lock);
+  Pid_t ppid = get_pid(CURPROC->parent);
+  Mutex_Unlock(& proc_table_lock);
+  return ppid;
+}
+
+
+/* 
+  Return the caller (for NOPROC) or a live child of the caller, or NULL.
+  Must be called with proc_table_lock held.
+ */
+static PCB* get_self_or_child(Pid_t pid)
+{
+  if(pid == NOPROC)
+    return CURPROC;
+  if(pid < 0 || pid >= MAX_PROC)
+    return NULL;
+
+  PCB* pcb = get_pcb(pid);
+  if(pcb == NULL || pcb->pstate != ALIVE)
+    return NULL;
+  if(pcb != CURPROC && pcb->parent != CURPROC)
+    return NULL;
+  return pcb;
+}
+
+int sys_SetNice(Pid_t pid, int nice)
+{
+  int ret = -1;
+  Mutex_Lock(& proc_table_lock);
+  PCB* pcb = get_self_or_child(pid);
+  if(pcb != NULL && nice >= NICE_MIN && nice <= NICE_MAX) {
+    /* The scheduler picks this up at the next scheduling decision of each thread */
+    pcb->nice = nice;
+    ret = 0;
+  }
+  Mutex_Unlock(& proc_table_lock);
+  return ret;
+}
+
+int sys_GetNice(Pid_t pid, int* nice)
+{
+  int ret = -1;
+  Mutex_Lock(& proc_table_lock);
+  PCB* pcb = get_self_or_child(pid);
+  if(pcb != NULL && nice != NULL) {
+    *nice = pcb->nice;
+    ret = 0;
+  }
+  Mutex_Unlock(& proc_table_lock);
+  return ret;
 }
 
 
@@ -252,7 +325,7 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(& proc_table_lock, & parent->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
   
@@ -276,7 +349,7 @@ static Pid_t wait_for_any_child(int* status)
     has_exited = ! is_rlist_empty(& parent->exited_list);
     if( has_exited ) break;
 
-    kernel_wait(& parent->child_exit, SCHED_USER);    
+    kernel_wait(& proc_table_lock, & parent->child_exit, SCHED_USER);
   }
 
   if(no_children)
@@ -293,15 +366,20 @@ static Pid_t wait_for_any_child(int* status)
 
 Pid_t sys_WaitChild(Pid_t cpid, int* status)
 {
+  Pid_t ret;
+  Mutex_Lock(& proc_table_lock);
+
   /* Wait for specific child. */
   if(cpid != NOPROC) {
-    return wait_for_specific_child(cpid, status);
+    ret = wait_for_specific_child(cpid, status);
   }
   /* Wait for any child */
   else {
-    return wait_for_any_child(status);
+    ret = wait_for_any_child(status);
   }
 
+  Mutex_Unlock(& proc_table_lock);
+  return ret;
 }
 
 
@@ -311,7 +389,9 @@ void sys_Exit(int exitval)
   PCB *curproc = CURPROC;  /* cache for efficiency */
 
   /* First, store the exit status */
+  Mutex_Lock(& proc_table_lock);
   curproc->exitval = exitval;
+  Mutex_Unlock(& proc_table_lock);
 
   /* 
     Here, we must check that we are not the init task. 
@@ -380,10 +460,13 @@ int procinfo_read(void* icb, char *buf, unsigned int n)
   if (info_cb->cursor == MAX_PROC)
       return 0;
   
+  Mutex_Lock(& proc_table_lock);
  	while(PT[info_cb->cursor].pstate == FREE){
     info_cb->cursor++;			// If process unavailable increase cursor to read the next process
-		if (info_cb->cursor == MAX_PROC)
+		if (info_cb->cursor == MAX_PROC) {
+      Mutex_Unlock(& proc_table_lock);
 		  return 0; // Cursor reached emd of process list
+    }
   }
 
   // Assigning values of info to send to openInfo
@@ -398,6 +481,7 @@ int procinfo_read(void* icb, char *buf, unsigned int n)
   int argl= (info_cb->info.argl > PROCINFO_MAX_ARGS_SIZE) ? PROCINFO_MAX_ARGS_SIZE : info_cb->info.argl;
 
 	memcpy(info_cb->info.args,(char *)PT[info_cb->cursor].args, sizeof(char)* argl );    // used to pass the process name 
+  Mutex_Unlock(& proc_table_lock);
 	memcpy(buf, (char*)&info_cb->info, sizeof(procinfo)); 				// pass info to the buffer
   
 	info_cb->cursor++; //move to the next PCB
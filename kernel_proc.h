@@ -34,6 +34,12 @@ typedef enum pid_state_e {
   @brief Process Control Block.
 
   This structure holds all information pertaining to a process.
+
+  The fields that relate the process to other processes (@c pstate,
+  @c parent, @c exitval, the children and exited lists, and the main 
+  task and its arguments) are protected by @c proc_table_lock. 
+  The fields used by the threads of the process (@c FIDT, @c ptcb_list, 
+  @c thread_count and the PTCBs in the list) are protected by @c lock.
  */
 typedef struct process_control_block {
   pid_state  pstate;      /**< @brief The pid state for this PCB */
@@ -62,9 +68,22 @@ typedef struct process_control_block {
  
   rlnode ptcb_list;       /***< @brief List of virtual threads */
   int thread_count;       /***< @brief Number of current threads in PTCB list */
+  int nice;               /**< @brief The nice value, which biases the scheduling of the threads */
+
+  Mutex lock;             /**< @brief Lock for the file table and the threads of the process */
 } PCB;
 
 
+/**
+  @brief The process table lock.
+
+  This protects the process table, the free list of PCBs, and the 
+  parent-child relation between processes. It is taken before the 
+  lock of any PCB (see @ref kernel_wait_wchan for the lock order).
+ */
+extern Mutex proc_table_lock;
+
+
 /**
   @brief Initialize the process table.
 
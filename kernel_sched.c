@@ -7,6 +7,13 @@
 #include "kernel_sched.h"
 #include "tinyos.h"
 
+#if defined(SCHED_STATISTICS)
+#include <stdio.h>
+#define SCHED_STAT(core, counter, n) ((core)->stats.counter += (n))
+#else
+#define SCHED_STAT(core, counter, n)
+#endif
+
 #ifndef NVALGRIND
 #include <valgrind/valgrind.h>
 #endif
@@ -52,337 +59,1856 @@ TCB* cur_thread()
 
 
 /*
-   The thread layout.
-  --------------------
+   The thread layout.
+  --------------------
+
+  On the x86 architecture, the stack grows downward. Therefore, we
+  allocate the TCB at the top of the memory block used as the stack,
+  and a guard page at the bottom.
+
+  +-------------+
+  |   TCB       |
+  +-------------+
+  | first frame |
+  +-------------+
+  |      |      |
+  |      v      |
+  |             |
+  |    stack    |
+  |             |
+  +-------------+
+  | guard page  |
+  +-------------+
+
+  The block is reserved with mmap, and the kernel commits the stack
+  pages lazily, as they are touched. The guard page is not accessible,
+  so that a stack overrun faults deterministically, instead of corrupting
+  the memory below the stack.
+
+  Disadvantages: The stack cannot grow. Of course, we do not support 
+  stack growth anyway!
+ */
+
+/*
+  A counter for active threads. By "active", we mean 'existing',
+  with the exception of idle threads (they don't count).
+ */
+volatile unsigned int active_threads = 0;
+Mutex active_threads_spinlock = MUTEX_INIT;
+
+/* This is specific to Intel Pentium! */
+#define SYSTEM_PAGE_SIZE (1 << 12)
+
+/* The memory allocated for the TCB must be a multiple of SYSTEM_PAGE_SIZE */
+#define THREAD_TCB_SIZE \
+	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
+
+/* The guard page below the stack */
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
+
+/* The size of the memory block of a thread with the given stack size */
+#define THREAD_SIZE(stack_size) (THREAD_GUARD_SIZE + (stack_size) + THREAD_TCB_SIZE)
+
+/*
+  Use mmap to allocate a thread block, making the lowest page the guard page.
+ */
+void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
+
+void* allocate_thread(size_t size)
+{
+	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_STACK, -1, 0);
+
+	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+	CHECK(mprotect(ptr, THREAD_GUARD_SIZE, PROT_NONE));
+
+	return ptr;
+}
+
+
+
+
+/*
+  This is the function that is used to start normal threads.
+*/
+
+void gain(int preempt); /* forward */
+
+static void thread_start()
+{
+	gain(1);
+	cur_thread()->thread_func();
+
+	/* We are not supposed to get here! */
+	assert(0);
+}
+
+
+/*
+  The thread cache.
+  -----------------
+
+  Free thread blocks with the default stack size are kept ready for reuse:
+  the context is initialized to start at thread_start() and the stack stays
+  registered with valgrind.
+  Each core has a cache of blocks (linked through sched_node) which is only
+  accessed by the core, with preemption off. Excess blocks overflow to a
+  global pool and are refilled from it in batches (see THREAD_CACHE_HIGH 
+  and THREAD_CACHE_LOW).
+ */
+static rlnode thread_pool;
+static unsigned int thread_pool_size;
+static Spinlock thread_pool_spinlock = SPINLOCK_INIT;
+
+/* The stack segment lies right below the TCB */
+static inline void* thread_stack(TCB* tcb) { return ((void*)tcb) - tcb->stack_size; }
+
+static void init_thread_block(TCB* tcb)
+{
+	/* Init the context */
+	cpu_initialize_context(&tcb->context, thread_stack(tcb), tcb->stack_size, thread_start);
+}
+
+/* The stack size must be a multiple of page size */
+static TCB* new_thread_block(size_t stack_size)
+{
+	void* block = allocate_thread(THREAD_SIZE(stack_size));
+	TCB* tcb = (TCB*)(block + THREAD_GUARD_SIZE + stack_size);
+	tcb->stack_size = stack_size;
+	init_thread_block(tcb);
+
+#ifndef NVALGRIND
+	void* sp = thread_stack(tcb);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + stack_size);
+#endif
+
+	return tcb;
+}
+
+static void free_thread_block(TCB* tcb)
+{
+#ifndef NVALGRIND
+	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
+#endif
+
+	free_thread(thread_stack(tcb) - THREAD_GUARD_SIZE, THREAD_SIZE(tcb->stack_size));
+}
+
+/*
+  A thread block may be the TCB of a mutex owner that another core reads
+  (see sched_inherit_priority), so it is not freed right away. A core 
+  announces in its pi_epoch the global epoch it reads an owner in (or 0).
+  The global epoch advances when no core reads in an older one, and a 
+  block retired in epoch E is freed once the global epoch is E+2: every 
+  read that could see the block has finished by then. Each core keeps 
+  the blocks it retired in a list, which it only accesses with preemption
+  off.
+ */
+static unsigned long pi_epoch = 1;
+
+static void pi_epoch_advance()
+{
+	unsigned long epoch = __atomic_load_n(&pi_epoch, __ATOMIC_SEQ_CST);
+	for (uint c = 0; c < cpu_cores(); c++) {
+		unsigned long reading = __atomic_load_n(&cctx[c].pi_epoch, __ATOMIC_SEQ_CST);
+		if (reading != 0 && reading != epoch)
+			return;
+	}
+	__atomic_compare_exchange_n(&pi_epoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/* Free the retired blocks of a core that no other core can be reading */
+static void thread_reclaim(CCB* core)
+{
+	if (is_rlist_empty(&core->thread_retired))
+		return;
+
+	pi_epoch_advance();
+	unsigned long epoch = __atomic_load_n(&pi_epoch, __ATOMIC_SEQ_CST);
+	while (!is_rlist_empty(&core->thread_retired)
+		&& core->thread_retired.next->tcb->retire_epoch + 2 <= epoch)
+		free_thread_block(rlist_pop_front(&core->thread_retired)->tcb);
+}
+
+/* Must be called with preemption off */
+static void retire_thread_block(CCB* core, TCB* tcb)
+{
+	tcb->retire_epoch = __atomic_load_n(&pi_epoch, __ATOMIC_SEQ_CST);
+	rlnode_init(&tcb->sched_node, tcb);
+	rlist_push_back(&core->thread_retired, &tcb->sched_node);
+}
+
+/* Must be called with preemption off */
+static TCB* thread_cache_get(CCB* core)
+{
+	if (core->thread_cache_size == 0 && thread_pool_size > 0) {
+		/* Refill from the global pool */
+		Spinlock_Lock(&thread_pool_spinlock);
+		while (core->thread_cache_size < THREAD_CACHE_LOW && thread_pool_size > 0) {
+			rlist_push_back(&core->thread_cache, rlist_pop_front(&thread_pool));
+			thread_pool_size--;
+			core->thread_cache_size++;
+		}
+		Spinlock_Unlock(&thread_pool_spinlock);
+	}
+
+	if (core->thread_cache_size == 0)
+		return new_thread_block(THREAD_STACK_SIZE);
+
+	core->thread_cache_size--;
+	return rlist_pop_front(&core->thread_cache)->tcb;
+}
+
+/* Must be called with preemption off */
+static void thread_cache_put(CCB* core, TCB* tcb)
+{
+	init_thread_block(tcb);
+	rlnode_init(&tcb->sched_node, tcb);
+	rlist_push_front(&core->thread_cache, &tcb->sched_node);
+	core->thread_cache_size++;
+
+	if (core->thread_cache_size <= THREAD_CACHE_HIGH)
+		return;
+
+	/* Trim to the low watermark */
+	rlnode excess;
+	rlnode_init(&excess, NULL);
+	Spinlock_Lock(&thread_pool_spinlock);
+	while (core->thread_cache_size > THREAD_CACHE_LOW) {
+		rlnode* node = rlist_pop_back(&core->thread_cache);
+		core->thread_cache_size--;
+		if (thread_pool_size < THREAD_POOL_MAX) {
+			rlist_push_back(&thread_pool, node);
+			thread_pool_size++;
+		} else
+			rlist_push_back(&excess, node);
+	}
+	Spinlock_Unlock(&thread_pool_spinlock);
+
+	while (!is_rlist_empty(&excess))
+		retire_thread_block(core, rlist_pop_front(&excess)->tcb);
+}
+
+/* Free the cached and retired blocks of a core, and the global pool */
+static void thread_cache_drain(CCB* core)
+{
+	while (!is_rlist_empty(&core->thread_retired))
+		free_thread_block(rlist_pop_front(&core->thread_retired)->tcb);
+
+	while (!is_rlist_empty(&core->thread_cache))
+		free_thread_block(rlist_pop_front(&core->thread_cache)->tcb);
+	core->thread_cache_size = 0;
+
+	Spinlock_Lock(&thread_pool_spinlock);
+	while (!is_rlist_empty(&thread_pool))
+		free_thread_block(rlist_pop_front(&thread_pool)->tcb);
+	thread_pool_size = 0;
+	Spinlock_Unlock(&thread_pool_spinlock);
+}
+
+/*
+  The nice value of the process of a thread biases the range of its 
+  MLFQ levels, the level it starts from, and its quantum.
+*/
+
+/* The levels of bias of the nice value of the process of a thread */
+static inline int nice_levels(TCB* tcb)
+{
+	return tcb->owner_pcb->nice / NICE_PER_LEVEL;
+}
+
+/* The lowest MLFQ level of a thread */
+static inline int mlfq_floor(TCB* tcb)
+{
+	int levels = -nice_levels(tcb);
+	return (levels > 0) ? levels : 0;
+}
+
+/* The highest MLFQ level of a thread */
+static inline int mlfq_ceiling(TCB* tcb)
+{
+	int levels = nice_levels(tcb);
+	return PRIORITY_QUEUES - 1 - ((levels > 0) ? levels : 0);
+}
+
+/* Clamp a level to the MLFQ levels of a thread */
+static inline int mlfq_clamp(TCB* tcb, int level)
+{
+	int floor = mlfq_floor(tcb), ceiling = mlfq_ceiling(tcb);
+	return (level < floor) ? floor : (level > ceiling) ? ceiling : level;
+}
+
+/* Scale the quantum of a thread: from 2 times at NICE_MIN, to 1/20 at NICE_MAX */
+static inline TimerDuration nice_quantum(TCB* tcb, TimerDuration quantum)
+{
+	return quantum * (NICE_MAX + 1 - tcb->owner_pcb->nice) / (NICE_MAX + 1);
+}
+
+/*
+  Initialize and return a new TCB
+*/
+
+TCB* spawn_thread(PCB* pcb, void (*func)())
+{
+	return spawn_thread_stack(pcb, func, THREAD_STACK_SIZE);
+}
+
+TCB* spawn_thread_stack(PCB* pcb, void (*func)(), size_t stack_size)
+{
+	stack_size = ((stack_size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE;
+
+	int preempt = preempt_off;
+	TCB* tcb = (stack_size == THREAD_STACK_SIZE) ? 
+		thread_cache_get(&CURCORE) : new_thread_block(stack_size);
+
+	/* Set the owner */
+	tcb->owner_pcb = pcb;
+
+	/* Initialize the other attributes */
+	tcb->type = NORMAL_THREAD;
+	tcb->state = INIT;
+	tcb->phase = CTX_CLEAN;
+	tcb->thread_func = func;
+	tcb->wakeup_time = NO_TIMEOUT;
+	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
+	avl_node_init(&tcb->sched_tree_node, tcb);
+	tcb->vruntime = 0;
+	tcb->rt_runtime = 0;
+	tcb->rt_density = 0;
+	tcb->rt_core = NULL;
+	tcb->rt_misses = 0;
+	tcb->affinity = CPUMASK_ALL;
+	tcb->core = &CURCORE; /* Start on the creator's core */
+	if (preempt) preempt_on;
+
+	tcb->its = QUANTUM;
+	tcb->rts = QUANTUM;
+	tcb->last_cause = SCHED_IDLE;
+	tcb->curr_cause = SCHED_IDLE;
+
+	/* initializing priority to the default, biased by the nice value */
+	tcb->base_priority = THREAD_PRIORITY_DEFAULT;
+	tcb->slice_shift = 0;
+	tcb->pi_saved = -1;
+	tcb->pi_nlocks = 0;
+	tcb->pi_nreleased = 0;
+	tcb->priority = mlfq_clamp(tcb, tcb->base_priority - nice_levels(tcb));
+
+	/* increase the count of active threads */
+	Mutex_Lock(&active_threads_spinlock);
+	active_threads++;
+	Mutex_Unlock(&active_threads_spinlock);
+
+	return tcb;
+}
+
+/*
+  This is called with preemption off, but not with the core's sched_spinlock
+  locked.
+ */
+void release_TCB(TCB* tcb)
+{
+	CCB* core = &CURCORE;
+	if (tcb->stack_size == THREAD_STACK_SIZE)
+		thread_cache_put(core, tcb);
+	else
+		retire_thread_block(core, tcb);
+
+	/* Free the blocks retired earlier, as the epoch advances */
+	thread_reclaim(core);
+
+	Mutex_Lock(&active_threads_spinlock);
+	active_threads--;
+	Mutex_Unlock(&active_threads_spinlock);
+}
+
+/*
+ *
+ * Scheduler
+ *
+ */
+
+/*
+ *  Note: the scheduler routines are all in the non-preemptive domain.
+ */
+
+/*
+  Each core has its own scheduler queues, stored in its CCB. The run queue
+  of a core is managed by the scheduling policy, selected at boot (see
+  sched_class). The rest of the scheduler (timeouts, stealing, idling, 
+  context switching) does not depend on the policy.
+
+  Also, each core keeps the threads that went to sleep on it with a timeout
+  in a hashed timing wheel: a thread waking up at tick @c t (of length 
+  @c TIMEOUT_WHEEL_TICK) is in list @c t % TIMEOUT_WHEEL_SLOTS. Thus, adding
+  and removing a timeout takes constant time, and expiring the timeouts only
+  looks at the slots of the ticks that passed since the last time.
+
+  Both of these structures are protected by the @c sched_spinlock of the
+  core. The same lock also protects the state of every thread whose @c core
+  field points to this core. A running thread always belongs to the core it
+  is running on; a thread changes core only while it is READY in a run queue,
+  when some core steals it.
+
+  A core that has no ready threads of its own tries to steal the oldest 
+  thread of the core with the most ready threads. Also, a busy core 
+  periodically pulls threads from the busiest core, to even out their 
+  loads. Stealing and balancing run with the lock of the core already 
+  held, so they only try to take the lock of the victim, and give up if
+  it is busy.
+
+  Waking up a thread on another core (see sched_wakeup_on) needs the locks
+  of both cores. These are taken by sched_lock_pair, before either is 
+  held, in the order of the core ids; a core never waits for the lock of
+  a core with a lower id while holding its own. Thus, the two ways never 
+  deadlock.
+
+  Each thread has an affinity mask of the cores it may run on. A thread is
+  woken up on the core it last ran on, so that it finds its cache warm,
+  unless its affinity excludes that core; then, it is moved to an allowed 
+  core. Also, a core never steals a thread whose affinity excludes it.
+
+  An idle core halts, with its timer set for the next timeout in its
+  wheel (if any), so it does not wake up periodically. It is restarted when
+  a thread is added to its own queue. A thread added to the queue of a busy 
+  core restarts some other halted core, which will steal it.
+
+  A core (other than core 0, which takes the serial interrupts) that stays 
+  idle with low utilisation for SCHED_PARK_DELAY is parked: it halts with 
+  no timer, it is not restarted to steal threads, and threads are not woken 
+  up on it. A busy core with SCHED_UNPARK_DEPTH ready threads, which finds 
+  no halted core to restart, unparks one. An unparked core must stay idle
+  for SCHED_PARK_DELAY again before it parks, so that the cores do not 
+  flap between the two states.
+*/
+
+
+/********************************************
+	
+	Scheduling policies
+
+ *********************************************/
+
+/*
+  MLFQ policy.
+
+  The run queue is an array of doubly linked lists, one for each level of
+  the MLFQ. The priority of a thread drops when it uses up its quantum, and
+  rises when it waits for I/O, within the range allowed by the nice value
+  of its process. Every MAX_YIELDS yields, all queued threads are boosted
+  by one level. The quantum of a level is shorter the higher the level, 
+  so that interactive threads respond quickly, and CPU-bound threads at 
+  the bottom switch less often.
+
+  The non-empty levels of the MLFQ are kept in a bitmap, so that the
+  highest one is found with a single bit scan. The levels are mapped to
+  the lists of @c ready_queue with a rotation (@c queue_offset), so that
+  a priority boost (which moves every level up by one) is done by merging
+  the two top lists and rotating. The priority of a queued thread is 
+  fixed when it is dequeued, by the number of boosts since it was queued.
+*/
+
+#if PRIORITY_QUEUES > 32
+#error "The MLFQ bitmap supports at most 32 priority levels"
+#endif
+
+/* 
+  The quantum of an MLFQ level: from 4 quanta at the lowest level, down
+  to half a quantum at the top level, in equal steps.
+*/
+static inline TimerDuration mlfq_level_quantum(int level)
+{
+#if PRIORITY_QUEUES > 1
+	return 4 * QUANTUM - (7 * QUANTUM / 2) * level / (PRIORITY_QUEUES - 1);
+#else
+	return QUANTUM;
+#endif
+}
+
+/* The list of the given MLFQ level of a core */
+static inline rlnode* mlfq_level(CCB* core, int level)
+{
+	return &core->ready_queue[(level + core->queue_offset) % PRIORITY_QUEUES];
+}
+
+static void mlfq_init(CCB* core)
+{
+	for (int i = 0; i < PRIORITY_QUEUES; i++)
+		rlnode_init(&core->ready_queue[i], NULL);
+	core->ready_bitmap = 0;
+	core->queue_offset = 0;
+	core->boost_epoch = 0;
+	core->yield_counter = 0;
+}
+
+static void mlfq_enqueue(CCB* core, TCB* tcb)
+{
+	assert(tcb->priority < PRIORITY_QUEUES);
+	assert(tcb->priority >= 0);
+
+	/* Insert at the end of the specified scheduling list */
+	rlist_push_back(mlfq_level(core, tcb->priority), &tcb->sched_node);
+	core->ready_bitmap |= 1u << tcb->priority;
+	tcb->boost_epoch = core->boost_epoch;
+}
+
+static void mlfq_dequeue(CCB* core, TCB* tcb)
+{
+	/* Apply the boosts that happened while the thread was queued */
+	unsigned long boosts = core->boost_epoch - tcb->boost_epoch;
+	int level = (boosts >= PRIORITY_QUEUES - 1 - tcb->priority) 
+		? PRIORITY_QUEUES - 1 : tcb->priority + (int)boosts;
+
+	/* This is the level the thread is in now */
+	rlnode* list = mlfq_level(core, level);
+
+	rlist_remove(&tcb->sched_node);
+	if (is_rlist_empty(list))
+		core->ready_bitmap &= ~(1u << level);
+
+	/* The nice value may have changed while the thread was queued */
+	tcb->priority = mlfq_clamp(tcb, level);
+}
+
+/* The head of the highest-priority non-empty list */
+static TCB* mlfq_pick_next(CCB* core)
+{
+	if (core->ready_bitmap == 0)
+		return NULL;
+
+	int level = 31 - __builtin_clz(core->ready_bitmap);
+	TCB* tcb = mlfq_level(core, level)->next->tcb;
+	mlfq_dequeue(core, tcb);
+	return tcb;
+}
+
+/*
+  Raise the priority of every queued thread of the core by one level. 
+  The top two levels are merged (the old top level first) and the levels
+  are rotated, so this takes constant time.
+*/
+static void mlfq_boost(CCB* core)
+{
+	const unsigned int top = 1u << (PRIORITY_QUEUES - 1);
+
+	rlist_prepend(mlfq_level(core, PRIORITY_QUEUES - 2), mlfq_level(core, PRIORITY_QUEUES - 1));
+	core->queue_offset = (core->queue_offset + PRIORITY_QUEUES - 1) % PRIORITY_QUEUES;
+
+	core->ready_bitmap = ((core->ready_bitmap << 1) | (core->ready_bitmap & top)) & (2 * top - 1);
+	core->boost_epoch++;
+}
+
+/* Boost every MAX_YIELDS yields */
+static void mlfq_count_yield(CCB* core)
+{
+	core->yield_counter++;
+	if (core->yield_counter == MAX_YIELDS) {
+		mlfq_boost(core);
+		core->yield_counter = 0;
+	}
+}
+
+/* The level the MLFQ adjusts: a thread keeps the level it inherited */
+static inline int* mlfq_own_level(TCB* tcb)
+{
+	return (tcb->pi_saved >= 0) ? &tcb->pi_saved : &tcb->priority;
+}
+
+static void mlfq_on_tick(CCB* core, TCB* tcb)
+{
+	int* level = mlfq_own_level(tcb);
+	*level = mlfq_clamp(tcb, *level - 1);
+	mlfq_count_yield(core);
+}
+
+static void mlfq_on_block(CCB* core, TCB* tcb, enum SCHED_CAUSE cause)
+{
+	int* level = mlfq_own_level(tcb);
+	switch (cause) {
+	case SCHED_IO:
+		*level = mlfq_clamp(tcb, *level + 1);
+		break;
+	case SCHED_MUTEX:
+		if (tcb->last_cause == tcb->curr_cause)
+			*level = mlfq_clamp(tcb, *level - 1);
+		break;
+	default:
+		*level = mlfq_clamp(tcb, *level);
+		break;
+	}
+	mlfq_count_yield(core);
+}
+
+static TimerDuration mlfq_quantum(TCB* tcb) { return mlfq_level_quantum(tcb->priority); }
+
+static const sched_class mlfq_class = {
+	.name = "mlfq",
+	.init = mlfq_init,
+	.enqueue = mlfq_enqueue,
+	.dequeue = mlfq_dequeue,
+	.pick_next = mlfq_pick_next,
+	.on_tick = mlfq_on_tick,
+	.on_block = mlfq_on_block,
+	.quantum = mlfq_quantum
+};
+
+
+/*
+  CFS policy.
+
+  Each thread accumulates the time it runs in its @c vruntime, and the
+  thread with the smallest @c vruntime runs next. The run queue is a 
+  balanced tree ordered by @c vruntime. 
+
+  The virtual time of the core (@c min_vruntime) follows the @c vruntime
+  of the threads it runs. A thread which is queued with a @c vruntime
+  well behind it (e.g., a thread that slept for a long time, a new 
+  thread, or a thread from another core) is placed at most
+  CFS_WAKEUP_CREDIT behind it, so that it cannot monopolize the core.
+*/
+
+#define CFS_WAKEUP_CREDIT (QUANTUM / 2)
+
+static int cfs_less(avl_node* a, avl_node* b)
+{
+	return a->tcb->vruntime < b->tcb->vruntime;
+}
+
+static void cfs_init(CCB* core)
+{
+	avl_init(&core->timeline, cfs_less);
+	core->min_vruntime = 0;
+}
+
+static void cfs_enqueue(CCB* core, TCB* tcb)
+{
+	if (tcb->vruntime + CFS_WAKEUP_CREDIT < core->min_vruntime)
+		tcb->vruntime = core->min_vruntime - CFS_WAKEUP_CREDIT;
+	avl_insert(&core->timeline, &tcb->sched_tree_node);
+}
+
+static void cfs_dequeue(CCB* core, TCB* tcb)
+{
+	avl_remove(&core->timeline, &tcb->sched_tree_node);
+}
+
+static TCB* cfs_pick_next(CCB* core)
+{
+	avl_node* first = avl_first(&core->timeline);
+	if (first == NULL)
+		return NULL;
+
+	TCB* tcb = first->tcb;
+	avl_remove(&core->timeline, first);
+	if (tcb->vruntime > core->min_vruntime)
+		core->min_vruntime = tcb->vruntime;
+	return tcb;
+}
+
+/* Charge the thread for the part of its quantum it used */
+static void cfs_account(CCB* core, TCB* tcb)
+{
+	tcb->vruntime += (tcb->rts < tcb->its) ? tcb->its - tcb->rts : 0;
+}
+
+static void cfs_on_tick(CCB* core, TCB* tcb) { cfs_account(core, tcb); }
+
+static void cfs_on_block(CCB* core, TCB* tcb, enum SCHED_CAUSE cause) { cfs_account(core, tcb); }
+
+static TimerDuration cfs_quantum(TCB* tcb) { return QUANTUM; }
+
+static const sched_class cfs_class = {
+	.name = "cfs",
+	.init = cfs_init,
+	.enqueue = cfs_enqueue,
+	.dequeue = cfs_dequeue,
+	.pick_next = cfs_pick_next,
+	.on_tick = cfs_on_tick,
+	.on_block = cfs_on_block,
+	.quantum = cfs_quantum
+};
+
+
+/*
+  Round-robin policy.
+
+  A single FIFO queue (the first list of @c ready_queue).
+*/
+
+static void rr_init(CCB* core) { rlnode_init(&core->ready_queue[0], NULL); }
+
+static void rr_enqueue(CCB* core, TCB* tcb) { rlist_push_back(&core->ready_queue[0], &tcb->sched_node); }
+
+static void rr_dequeue(CCB* core, TCB* tcb) { rlist_remove(&tcb->sched_node); }
+
+static TCB* rr_pick_next(CCB* core)
+{
+	if (is_rlist_empty(&core->ready_queue[0]))
+		return NULL;
+	return rlist_pop_front(&core->ready_queue[0])->tcb;
+}
+
+static void rr_on_tick(CCB* core, TCB* tcb) {}
+
+static void rr_on_block(CCB* core, TCB* tcb, enum SCHED_CAUSE cause) {}
+
+static TimerDuration rr_quantum(TCB* tcb) { return QUANTUM; }
+
+static const sched_class rr_class = {
+	.name = "rr",
+	.init = rr_init,
+	.enqueue = rr_enqueue,
+	.dequeue = rr_dequeue,
+	.pick_next = rr_pick_next,
+	.on_tick = rr_on_tick,
+	.on_block = rr_on_block,
+	.quantum = rr_quantum
+};
+
+
+/*
+  Real-time (EDF) class.
+
+  This is not a policy selected at boot, but a class above it: the 
+  real-time threads of a core are kept in a run queue of their own, 
+  ordered by absolute deadline, and run before the threads of the policy.
+
+  A real-time thread gets a budget of @c rt_runtime in every period. A new
+  period starts when the thread is queued or charged after the end of the
+  previous one, and its deadline is @c rt_rel_deadline after that. A 
+  thread which used up its budget is throttled: it waits in the 
+  @c rt_throttled list of its core until the end of its period. It is
+  not counted in the @c ready_count of the core until it is released, so
+  that the load decisions of the scheduler only see threads that can run.
+  A thread misses its deadline if it has not blocked by then; this is 
+  counted (once per period) when the thread is next charged or released.
+*/
+
+static inline int is_rt_thread(TCB* tcb) { return tcb->rt_runtime != 0; }
+
+static inline int is_rt_throttled(TCB* tcb) { return is_rt_thread(tcb) && tcb->rt_budget == 0; }
+
+static int edf_less(avl_node* a, avl_node* b)
+{
+	return a->tcb->rt_deadline < b->tcb->rt_deadline;
+}
+
+/* Start a new period, if the current one has ended */
+static void edf_replenish(TCB* tcb, TimerDuration now)
+{
+	if (now < tcb->rt_period_end)
+		return;
+
+	tcb->rt_budget = tcb->rt_runtime;
+	tcb->rt_deadline = now + tcb->rt_rel_deadline;
+	tcb->rt_period_end = now + tcb->rt_period;
+	tcb->rt_missed = 0;
+}
+
+static void edf_init(CCB* core)
+{
+	avl_init(&core->rt_timeline, edf_less);
+	rlnode_init(&core->rt_throttled, NULL);
+	core->curr_deadline = NO_TIMEOUT;
+}
+
+static void edf_enqueue(CCB* core, TCB* tcb)
+{
+	edf_replenish(tcb, bios_clock());
+
+	if (tcb->rt_budget > 0)
+		avl_insert(&core->rt_timeline, &tcb->sched_tree_node);
+	else {
+		rlist_push_back(&core->rt_throttled, &tcb->sched_node);
+
+		/* A throttled thread cannot be handed the core */
+		if (core->handoff == tcb)
+			core->handoff = NULL;
+	}
+}
+
+static void edf_dequeue(CCB* core, TCB* tcb)
+{
+	if (tcb->rt_budget > 0)
+		avl_remove(&core->rt_timeline, &tcb->sched_tree_node);
+	else
+		rlist_remove(&tcb->sched_node);
+}
+
+static TCB* edf_pick_next(CCB* core)
+{
+	avl_node* first = avl_first(&core->rt_timeline);
+	if (first == NULL)
+		return NULL;
+
+	avl_remove(&core->rt_timeline, first);
+	return first->tcb;
+}
+
+/* Count a missed deadline, once per period */
+static void edf_check_deadline(TCB* tcb, TimerDuration now)
+{
+	if (now > tcb->rt_deadline && !tcb->rt_missed) {
+		tcb->rt_misses++;
+		tcb->rt_missed = 1;
+	}
+}
+
+/* Charge the thread for the part of its time slice it used */
+static void edf_account(CCB* core, TCB* tcb)
+{
+	TimerDuration now = bios_clock();
+	TimerDuration used = (tcb->rts < tcb->its) ? tcb->its - tcb->rts : 0;
+
+	tcb->rt_budget = (used < tcb->rt_budget) ? tcb->rt_budget - used : 0;
+	edf_check_deadline(tcb, now);
+	edf_replenish(tcb, now);
+}
+
+static void edf_on_tick(CCB* core, TCB* tcb) { edf_account(core, tcb); }
+
+static void edf_on_block(CCB* core, TCB* tcb, enum SCHED_CAUSE cause) { edf_account(core, tcb); }
+
+/* The time slice of a real-time thread is limited by its budget */
+static TimerDuration edf_quantum(TCB* tcb)
+{
+	return (tcb->rt_budget < QUANTUM) ? tcb->rt_budget : QUANTUM;
+}
+
+/* 
+  Move the throttled threads whose period has ended to the run queue. 
+  A throttled thread had not blocked, so it missed its deadline if that
+  has passed.
+*/
+static void edf_release_throttled(CCB* core)
+{
+	TimerDuration now = bios_clock();
+
+	for (rlnode* n = core->rt_throttled.next; n != &core->rt_throttled;) {
+		TCB* tcb = n->tcb;
+		n = n->next;
+		if (tcb->rt_period_end <= now) {
+			rlist_remove(&tcb->sched_node);
+			edf_check_deadline(tcb, now);
+			edf_replenish(tcb, now);
+			avl_insert(&core->rt_timeline, &tcb->sched_tree_node);
+			core->ready_count++;
+		}
+	}
+}
+
+/* The earliest end of period of the throttled threads, or NO_TIMEOUT */
+static TimerDuration edf_next_release(CCB* core)
+{
+	TimerDuration next = NO_TIMEOUT;
+	for (rlnode* n = core->rt_throttled.next; n != &core->rt_throttled; n = n->next)
+		if (n->tcb->rt_period_end < next)
+			next = n->tcb->rt_period_end;
+	return next;
+}
+
+static const sched_class edf_class = {
+	.name = "edf",
+	.init = edf_init,
+	.enqueue = edf_enqueue,
+	.dequeue = edf_dequeue,
+	.pick_next = edf_pick_next,
+	.on_tick = edf_on_tick,
+	.on_block = edf_on_block,
+	.quantum = edf_quantum
+};
+
+
+/* The policy selected at boot */
+static const sched_class* sched_policy_class = &mlfq_class;
+
+/* The class of a thread */
+static inline const sched_class* sched_class_of(TCB* tcb)
+{
+	return is_rt_thread(tcb) ? &edf_class : sched_policy_class;
+}
+
+/* 
+  The time slice of a thread: the quantum of its class, scaled by its nice
+  value, and grown if it keeps using it up without contention. 
+*/
+static TimerDuration sched_quantum(TCB* tcb)
+{
+	TimerDuration quantum = sched_class_of(tcb)->quantum(tcb);
+	if (is_rt_thread(tcb))
+		return quantum;
+
+	quantum = nice_quantum(tcb, quantum) << tcb->slice_shift;
+	return (quantum < SCHED_SLICE_MAX) ? quantum : SCHED_SLICE_MAX;
+}
+
+/*
+  Grow the time slice of a thread that used it up while no other thread 
+  waited for its core, since it would just be resumed; a thread that 
+  blocks, or has to share its core, starts over from its quantum.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void sched_adapt_slice(CCB* core, TCB* tcb, enum SCHED_CAUSE cause)
+{
+#if defined(SCHED_ADAPTIVE_QUANTUM)
+	if (cause == SCHED_QUANTUM && core->ready_count == 0) {
+		if (tcb->slice_shift < SCHED_SLICE_SHIFT_MAX)
+			tcb->slice_shift++;
+	} else
+		tcb->slice_shift = 0;
+#endif
+}
+
+/* 
+  Replace a density admitted to a core by another, if the bandwidth of
+  the core allows it. Return 1 on success, 0 if the new density is not 
+  admitted. The bandwidth of a core is updated atomically, since threads 
+  of other cores may be admitted to it.
+*/
+static int sched_rt_admit(CCB* core, unsigned long old, unsigned long new)
+{
+	unsigned long used = __atomic_load_n(&core->rt_bandwidth, __ATOMIC_RELAXED);
+	do {
+		if (new > old && used - old + new > RT_BANDWIDTH)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&core->rt_bandwidth, &used, used - old + new,
+		0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return 1;
+}
+
+
+/********************************************
+	
+	Scheduler
+
+ *********************************************/
+
+/* Interrupt handler for ALARM */
+void yield_handler() { yield(SCHED_QUANTUM); }
+
+/* Interrupt handler for inter-core interrupts, sent to preempt the core */
+void ici_handler() { yield(SCHED_PREEMPT); }
+
+#if MAX_CORES > CPUMASK_SIZE
+#error "The affinity masks cannot hold MAX_CORES cores"
+#endif
+
+/* The mask of the cores of the machine */
+static inline cpumask_t sched_all_cores()
+{
+	return cpumask_first_n(cpu_cores());
+}
+
+/* Check whether the affinity of a thread allows it to run on a core */
+static inline int sched_core_allowed(CCB* core, TCB* tcb)
+{
+	/* A real-time thread only runs on the core it was admitted to */
+	if (tcb->rt_core != NULL)
+		return core == tcb->rt_core;
+	return cpumask_isset(&tcb->affinity, core->id);
+}
+
+/* Check whether the affinity of a thread allows it to run on some other core */
+static inline int sched_other_core_allowed(CCB* core, TCB* tcb)
+{
+	if (tcb->rt_core != NULL)
+		return core != tcb->rt_core;
+
+	cpumask_t others = cpumask_and(tcb->affinity, sched_all_cores());
+	cpumask_clear(&others, core->id);
+	return !cpumask_empty(others);
+}
+
+/*
+  Choose a core for a thread whose affinity excludes its own core: the 
+  current core if it is allowed, else the allowed core with the fewest 
+  ready threads.
+*/
+static CCB* sched_affine_core(TCB* tcb)
+{
+	CCB* best = &CURCORE;
+	if (sched_core_allowed(best, tcb))
+		return best;
+
+	/* A parked core is only chosen if there is no other */
+	best = NULL;
+	int best_parked = 1;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		CCB* core = &cctx[c];
+		if (!sched_core_allowed(core, tcb))
+			continue;
+		int parked = __atomic_load_n(&core->parked, __ATOMIC_RELAXED);
+		if (best == NULL || parked < best_parked || (parked == best_parked
+			&& __atomic_load_n(&core->ready_count, __ATOMIC_RELAXED) 
+				< __atomic_load_n(&best->ready_count, __ATOMIC_RELAXED))) {
+			best = core;
+			best_parked = parked;
+		}
+	}
+	assert(best != NULL);
+	return best;
+}
+
+/*
+  Lock the core that a thread belongs to, and return it.
+
+  The core of a READY thread may change while we are waiting for the lock 
+  (some other core stole it), so we check again after taking the lock.
+*/
+static CCB* sched_lock_thread(TCB* tcb)
+{
+	while (1) {
+		CCB* core = __atomic_load_n(&tcb->core, __ATOMIC_ACQUIRE);
+		Spinlock_Lock(&core->sched_spinlock);
+		if (core == tcb->core)
+			return core;
+		Spinlock_Unlock(&core->sched_spinlock);
+	}
+}
+
+/*
+  Lock the current core and the core that a thread belongs to (which may
+  be the same), and return the latter. The two locks are taken in the
+  order of the core ids, to avoid deadlocks.
+*/
+static CCB* sched_lock_pair(CCB* core, TCB* tcb)
+{
+	while (1) {
+		CCB* other = __atomic_load_n(&tcb->core, __ATOMIC_ACQUIRE);
+		CCB* first = (core->id < other->id) ? core : other;
+		CCB* second = (core->id < other->id) ? other : core;
+
+		Spinlock_Lock(&first->sched_spinlock);
+		if (second != first)
+			Spinlock_Lock(&second->sched_spinlock);
+		if (other == tcb->core)
+			return other;
+		if (second != first)
+			Spinlock_Unlock(&second->sched_spinlock);
+		Spinlock_Unlock(&first->sched_spinlock);
+	}
+}
+
+/*
+  Possibly add TCB to the timeout wheel of the core.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void sched_register_timeout(CCB* core, TCB* tcb, TimerDuration timeout)
+{
+	if (timeout != NO_TIMEOUT) {
+		/* set the wakeup time */
+		TimerDuration curtime = bios_clock();
+		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+
+		/* add to the slot of its tick, or to the next slot to expire if that passed */
+		TimerDuration tick = tcb->wakeup_time / TIMEOUT_WHEEL_TICK;
+		if (tick < core->wheel_tick)
+			tick = core->wheel_tick;
+		rlist_push_back(&core->timeout_wheel[tick % TIMEOUT_WHEEL_SLOTS], &tcb->sched_node);
+	}
+}
+
+/*
+  Add TCB to the end of the scheduler list of the core.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void sched_queue_add(CCB* core, TCB* tcb)
+{
+	assert(tcb->core == core);
+
+	sched_class_of(tcb)->enqueue(core, tcb);
+	if (!is_rt_throttled(tcb))
+		core->ready_count++;
+
+	/* 
+		Restart the core, if it is idle. Clearing the flag coalesces the 
+		restarts of a burst of wakeups. A real-time thread preempts the 
+		core, if its deadline is earlier than that of the thread running
+		there. Else, some halted core may come and steal the thread 
+		(unless it cannot run on any other core). This holds for a thread
+		handed off to this core, too: if the current thread does not block
+		soon after all, the handoff thread must not wait for its quantum.
+	*/
+	if (core->idle) {
+		core->idle = 0;
+		cpu_core_restart(core->id);
+	} else if (is_rt_thread(tcb) && tcb->rt_budget > 0 && tcb->rt_deadline < core->curr_deadline) {
+		core->curr_deadline = tcb->rt_deadline;
+		cpu_ici(core->id);
+	} else if (sched_other_core_allowed(core, tcb))
+		cpu_core_restart_one();
+}
+
+/*
+	Adjust the state of a thread to make it READY.
+
+	*** MUST BE CALLED WITH core->sched_spinlock HELD ***
+ */
+static void sched_make_ready(CCB* core, TCB* tcb)
+{
+	assert(tcb->state == STOPPED || tcb->state == INIT);
+
+	/* Possibly remove from the timeout wheel */
+	if (tcb->wakeup_time != NO_TIMEOUT) {
+		/* tcb is in the timeout wheel, fix it */
+		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
+		rlist_remove(&tcb->sched_node);
+		tcb->wakeup_time = NO_TIMEOUT;
+	}
+
+	/* Mark as ready */
+	tcb->state = READY;
+
+	/* Possibly add to the scheduler queue */
+	if (tcb->phase == CTX_CLEAN)
+		sched_queue_add(core, tcb);
+}
+
+/*
+  Scan the slots of the timeout wheel of the core, for the ticks up to now,
+  for threads whose timeout has expired, and wake them up. The slot of the 
+  current tick is scanned again next time, since it may get more entries.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void sched_wakeup_expired_timeouts(CCB* core)
+{
+	TimerDuration curtime = bios_clock();
+	TimerDuration curtick = curtime / TIMEOUT_WHEEL_TICK;
+
+	/* A full turn of the wheel scans every slot */
+	if (curtick - core->wheel_tick >= TIMEOUT_WHEEL_SLOTS)
+		core->wheel_tick = curtick - TIMEOUT_WHEEL_SLOTS + 1;
+
+	for (TimerDuration tick = core->wheel_tick; tick <= curtick; tick++) {
+		rlnode* slot = &core->timeout_wheel[tick % TIMEOUT_WHEEL_SLOTS];
+
+		/* Entries of later turns of the wheel stay in the slot */
+		for (rlnode* n = slot->next; n != slot;) {
+			TCB* tcb = n->tcb;
+			n = n->next;
+			if (tcb->wakeup_time <= curtime)
+				sched_make_ready(core, tcb);
+		}
+	}
+
+	core->wheel_tick = curtick;
+}
+
+/*
+  Return the earliest wakeup time in the timeout wheel of the core, or 
+  NO_TIMEOUT if the wheel is empty. The slots are scanned in tick order; 
+  an entry in the slot of tick t wakes up at tick t or at a later turn of 
+  the wheel, so we can stop at the first entry that wakes up at its tick.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TimerDuration sched_next_timeout(CCB* core)
+{
+	TimerDuration next = NO_TIMEOUT;
+
+	for (TimerDuration tick = core->wheel_tick; tick < core->wheel_tick + TIMEOUT_WHEEL_SLOTS; tick++) {
+		rlnode* slot = &core->timeout_wheel[tick % TIMEOUT_WHEEL_SLOTS];
+		for (rlnode* n = slot->next; n != slot; n = n->next)
+			if (n->tcb->wakeup_time < next)
+				next = n->tcb->wakeup_time;
+
+		if (next < (tick + 1) * TIMEOUT_WHEEL_TICK)
+			break;
+	}
+
+	return next;
+}
+
+/*
+  Remove a thread from the run queue of the core, and return it. 
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* sched_queue_remove(CCB* core, TCB* tcb)
+{
+	sched_class_of(tcb)->dequeue(core, tcb);
+	if (!is_rt_throttled(tcb))
+		core->ready_count--;
+
+	if (core->handoff == tcb)
+		core->handoff = NULL;
+
+	return tcb;
+}
+
+/*
+  Remove the real-time thread with the earliest deadline from the run 
+  queue of the core, else the thread the policy picks, and return it. 
+  Return NULL if the run queue is empty.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* sched_queue_pop(CCB* core)
+{
+	TCB* tcb = edf_pick_next(core);
+	if (tcb == NULL)
+		tcb = sched_policy_class->pick_next(core);
+	if (tcb == NULL)
+		return NULL;
+
+	core->ready_count--;
+	if (core->handoff == tcb)
+		core->handoff = NULL;
+
+	return tcb;
+}
+
+/*
+  The load of a core: its ready threads, plus the thread it is running
+  (unless it is idle). This is only a heuristic, so we do not lock.
+*/
+static inline unsigned int sched_core_load(CCB* core)
+{
+	return __atomic_load_n(&core->ready_count, __ATOMIC_RELAXED) 
+		+ !__atomic_load_n(&core->idle, __ATOMIC_RELAXED);
+}
+
+/*
+  Return the core, other than this one, with the highest load among the 
+  cores with ready threads, or NULL if there is none. Ties go to the core 
+  with the highest utilisation.
+*/
+static CCB* sched_busiest_core(CCB* core)
+{
+	CCB* busiest = NULL;
+	unsigned int most = 0, most_util = 0;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		CCB* other = &cctx[c];
+		if (other == core || __atomic_load_n(&other->ready_count, __ATOMIC_RELAXED) == 0)
+			continue;
+
+		unsigned int load = sched_core_load(other);
+		unsigned int util = __atomic_load_n(&other->util, __ATOMIC_RELAXED);
+		if (load > most || (load == most && util > most_util)) {
+			busiest = other;
+			most = load;
+			most_util = util;
+		}
+	}
+	return busiest;
+}
+
+/*
+  Remove a thread from the run queue of the victim core, and move it to 
+  this core. Return NULL if there is no thread, or if the thread the 
+  victim would run next cannot run on this core.
+
+  *** MUST BE CALLED WITH THE sched_spinlock OF BOTH CORES HELD ***
+*/
+static TCB* sched_queue_pull(CCB* core, CCB* victim)
+{
+	/* The head of a list is the thread that waited longest */
+	TCB* tcb = sched_queue_pop(victim);
+
+	/* A thread whose affinity excludes this core goes back */
+	if (tcb != NULL && !sched_core_allowed(core, tcb)) {
+		sched_class_of(tcb)->enqueue(victim, tcb);
+		victim->ready_count++;
+		tcb = NULL;
+	}
+
+	if (tcb != NULL)
+		__atomic_store_n(&tcb->core, core, __ATOMIC_RELEASE);
+
+	return tcb;
+}
+
+/*
+  Steal a thread from the busiest core, and move it to this core. Return 
+  NULL if there is nothing to steal, or if the victim core is busy.
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* sched_queue_steal(CCB* core)
+{
+	CCB* victim = sched_busiest_core(core);
+	if (victim == NULL || !Spinlock_TryLock(&victim->sched_spinlock))
+		return NULL;
 
-  +-------------+
-  |   TCB       |
-  +-------------+
-  |             |
-  |    stack    |
-  |             |
-  |      ^      |
-  |      |      |
-  +-------------+
-  | first frame |
-  +-------------+
+	TCB* tcb = sched_queue_pull(core, victim);
 
-  Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+	Spinlock_Unlock(&victim->sched_spinlock);
 
-  Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
-  we do not support stack growth anyway!
- */
+	if (tcb != NULL)
+		SCHED_STAT(core, steals, 1);
+	return tcb;
+}
 
 /*
-  A counter for active threads. By "active", we mean 'existing',
-  with the exception of idle threads (they don't count).
- */
-volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
+  Unpark some parked core, which will come and steal threads.
+*/
+static void sched_unpark_one()
+{
+	for (uint c = 1; c < cpu_cores(); c++) {
+		if (__atomic_load_n(&cctx[c].parked, __ATOMIC_RELAXED)
+			&& __atomic_exchange_n(&cctx[c].parked, 0, __ATOMIC_ACQ_REL)) {
+			cpu_core_restart(c);
+			return;
+		}
+	}
+}
 
-/* This is specific to Intel Pentium! */
-#define SYSTEM_PAGE_SIZE (1 << 12)
+/*
+  Even out the load of this core with that of the busiest core, by pulling
+  half the difference into the run queue of this core. Then, if this core
+  still has ready threads, restart a halted core to steal some. 
 
-/* The memory allocated for the TCB must be a multiple of SYSTEM_PAGE_SIZE */
-#define THREAD_TCB_SIZE \
-	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
+  This is done at most every SCHED_BALANCE_INTERVAL, when the quantum of 
+  the current thread expires. A busy core does not steal, since it always
+  has its current thread to run; without balancing, a core could run a 
+  single thread while another core time-shares many.
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void sched_balance(CCB* core, TCB* current)
+{
+	TimerDuration now = bios_clock();
+	if (now - core->last_balance < SCHED_BALANCE_INTERVAL)
+		return;
+	core->last_balance = now;
+	SCHED_STAT(core, balances, 1);
+
+	unsigned int load = core->ready_count + (current->type != IDLE_THREAD);
+	CCB* victim = sched_busiest_core(core);
+	unsigned int victim_load = (victim != NULL) ? sched_core_load(victim) : 0;
+
+	if (victim_load > load + 1) {
+		SCHED_STAT(core, imbalance, victim_load - load);
+
+		if (Spinlock_TryLock(&victim->sched_spinlock)) {
+			for (unsigned int n = (victim_load - load) / 2; n > 0; n--) {
+				TCB* tcb = sched_queue_pull(core, victim);
+				if (tcb == NULL)
+					break;
+				sched_class_of(tcb)->enqueue(core, tcb);
+				core->ready_count++;
+				SCHED_STAT(core, migrations, 1);
+			}
+			Spinlock_Unlock(&victim->sched_spinlock);
+		}
+	}
 
-//#define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
+	if (core->ready_count > 0 && !cpu_core_restart_one() && core->ready_count >= SCHED_UNPARK_DEPTH)
+		sched_unpark_one();
+}
 
-/*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
- */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
+/* 
+  Update the utilisation of the core, for the time since the last update.
+  The current thread ran for all that time.
 
-void* allocate_thread(size_t size)
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void sched_update_util(CCB* core, TCB* current)
 {
-	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	TimerDuration now = bios_clock();
+	TimerDuration delta = now - core->util_stamp;
+	core->util_stamp = now;
+	if (delta > SCHED_UTIL_PERIOD)
+		delta = SCHED_UTIL_PERIOD;
+
+	long busy = (current->type != IDLE_THREAD) ? SCHED_UTIL_SCALE : 0;
+	long util = core->util;
+	util += (busy - util) * (long)delta / (long)SCHED_UTIL_PERIOD;
+	__atomic_store_n(&core->util, (unsigned int)util, __ATOMIC_RELAXED);
+}
 
-	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+/*
+  Called when the core selects its idle thread: park the core, if it has 
+  been idle for SCHED_PARK_DELAY, its utilisation is low, and it has no 
+  timeouts to wake up for. If it cannot be parked, it is checked again 
+  after another SCHED_PARK_DELAY.
 
-	return ptr;
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void sched_check_park(CCB* core, TCB* current)
+{
+	TimerDuration now = bios_clock();
+	if (current->type != IDLE_THREAD) {
+		core->idle_since = now;
+		return;
+	}
+	if (core->id == 0 || core->parked || now - core->idle_since < SCHED_PARK_DELAY)
+		return;
+
+	if (core->util < SCHED_PARK_UTIL && core->ready_count == 0
+		&& sched_next_timeout(core) == NO_TIMEOUT && edf_next_release(core) == NO_TIMEOUT) {
+		__atomic_store_n(&core->parked, 1, __ATOMIC_RELEASE);
+		SCHED_STAT(core, parks, 1);
+	} else
+		core->idle_since = now;
 }
-#else
+
 /*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
- */
-void free_thread(void* ptr, size_t size) { free(ptr); }
+  Return the time at which an idle core should check whether it can be 
+  parked, or NO_TIMEOUT if it need not wake up for this.
 
-void* allocate_thread(size_t size)
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TimerDuration sched_park_time(CCB* core)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
-	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+	TimerDuration park_time = core->idle_since + SCHED_PARK_DELAY;
+	if (core->id == 0 || core->parked || park_time <= bios_clock())
+		return NO_TIMEOUT;
+	return park_time;
 }
-#endif
 
+/*
+  Select the next thread to run on the core. This is the head of the core's
+  own queues, else the current thread if it can continue, else a thread
+  stolen from another core, else the idle thread.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* sched_queue_select(CCB* core, TCB* current)
+{
+	TCB* next_thread = NULL;
+	int runnable = (current->state == READY && !is_rt_throttled(current) 
+		&& sched_core_allowed(core, current));
+	avl_node* first_rt = avl_first(&core->rt_timeline);
+
+	/* 
+		A thread handed off to this core runs first, if the current thread blocks 
+		(and no real-time thread is ready, unless it is a real-time thread too)
+	*/
+	if (core->handoff != NULL && current->state != READY
+		&& (first_rt == NULL || is_rt_thread(core->handoff)))
+		next_thread = sched_queue_remove(core, core->handoff);
+	core->handoff = NULL;
+
+	/* A real-time thread goes on, unless a thread with an earlier deadline is ready */
+	if (next_thread == NULL && runnable && is_rt_thread(current)
+		&& (first_rt == NULL || !edf_less(first_rt, &current->sched_tree_node)))
+		next_thread = current;
 
+	if (next_thread == NULL)
+		next_thread = sched_queue_pop(core);
 
+	if (next_thread == NULL && runnable && current->type != IDLE_THREAD)
+		next_thread = current;
 
-/*
-  This is the function that is used to start normal threads.
-*/
+	if (next_thread == NULL)
+		next_thread = sched_queue_steal(core);
 
-void gain(int preempt); /* forward */
+	/* In case all lists are empty the next thread will be the idle_thread*/
+	if (next_thread == NULL)
+		next_thread = runnable ? current : &core->idle_thread;
 
-static void thread_start()
-{
-	gain(1);
-	cur_thread()->thread_func();
+	next_thread->its = sched_quantum(next_thread);
+	core->curr_deadline = is_rt_thread(next_thread) ? next_thread->rt_deadline : NO_TIMEOUT;
 
-	/* We are not supposed to get here! */
-	assert(0);
+	return next_thread;
 }
 
 /*
-  Initialize and return a new TCB
-*/
-
-TCB* spawn_thread(PCB* pcb, void (*func)())
+  Make a blocked thread ready on the given core, moving it there. 
+  If handoff is set, the core is handed off to it.
+ */
+static int sched_wakeup_on(CCB* core, TCB* tcb, int handoff)
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	int ret = 0;
 
-	/* Set the owner */
-	tcb->owner_pcb = pcb;
+	CCB* other = sched_lock_pair(core, tcb);
 
-	/* Initialize the other attributes */
-	tcb->type = NORMAL_THREAD;
-	tcb->state = INIT;
-	tcb->phase = CTX_CLEAN;
-	tcb->thread_func = func;
-	tcb->wakeup_time = NO_TIMEOUT;
-	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
+	if (tcb->state == STOPPED || tcb->state == INIT) {
+		/* 
+			A thread which has not finished switching out on its core 
+			(CTX_DIRTY) is requeued by that core, so it cannot move.
+		*/
+		if (tcb->phase == CTX_CLEAN) {
+			if (tcb->wakeup_time != NO_TIMEOUT) {
+				/* Remove from the timeout wheel of the other core */
+				rlist_remove(&tcb->sched_node);
+				tcb->wakeup_time = NO_TIMEOUT;
+			}
+			__atomic_store_n(&tcb->core, core, __ATOMIC_RELEASE);
+			if (other != core)
+				SCHED_STAT(core, migrations, 1);
+
+			/* A previous handoff thread just stays in the queue */
+			if (handoff)
+				core->handoff = tcb;
+			sched_make_ready(core, tcb);
+		} else
+			sched_make_ready(other, tcb);
+		ret = 1;
+	}
 
-	tcb->its = QUANTUM;
-	tcb->rts = QUANTUM;
-	tcb->last_cause = SCHED_IDLE;
-	tcb->curr_cause = SCHED_IDLE;
+	if (other != core)
+		Spinlock_Unlock(&other->sched_spinlock);
+	Spinlock_Unlock(&core->sched_spinlock);
 
-	/* initializing priority to the middle (favoring Max priority)*/
-	tcb->priority = (int) (PRIORITY_QUEUES/2 + 1);
+	return ret;
+}
 
-	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+/*
+  Make the process ready. It is queued on the core it last ran on,
+  unless its affinity excludes that core, or that core is parked.
+ */
+int wakeup(TCB* tcb)
+{
+	int ret = 0;
 
-	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	/* Preemption off */
+	int oldpre = preempt_off;
 
-#ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
-#endif
+	/* To touch tcb->state, we must get the spinlock of its core. */
+	CCB* core = sched_lock_thread(tcb);
 
-	/* increase the count of active threads */
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads++;
-	Mutex_Unlock(&active_threads_spinlock);
+	int allowed = sched_core_allowed(core, tcb) && !core->parked;
+	if (allowed && (tcb->state == STOPPED || tcb->state == INIT)) {
+		sched_make_ready(core, tcb);
+		ret = 1;
+	}
 
-	return tcb;
+	Spinlock_Unlock(&core->sched_spinlock);
+
+	if (!allowed)
+		ret = sched_wakeup_on(sched_affine_core(tcb), tcb, 0);
+
+	/* Restore preemption state */
+	if (oldpre)
+		preempt_on;
+
+	return ret;
 }
 
 /*
-  This is called with sched_spinlock locked !
+  Make the thread ready on the current core, to run when the current
+  thread blocks (unless its affinity excludes the current core).
  */
-void release_TCB(TCB* tcb)
+int wakeup_handoff(TCB* tcb)
 {
-#ifndef NVALGRIND
-	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
-#endif
+	int oldpre = preempt_off;
 
-	free_thread(tcb, THREAD_SIZE);
+	CCB* core = &CURCORE;
+	int ret = sched_core_allowed(core, tcb) ? sched_wakeup_on(core, tcb, 1) : wakeup(tcb);
 
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads--;
-	Mutex_Unlock(&active_threads_spinlock);
-}
+	if (oldpre)
+		preempt_on;
 
-/*
- *
- * Scheduler
- *
- */
+	return ret;
+}
 
 /*
- *  Note: the scheduler routines are all in the non-preemptive domain.
+  Set the priority of a thread. A queued thread is moved to its new level.
  */
+void sched_set_priority(TCB* tcb, int priority)
+{
+	int oldpre = preempt_off;
+	CCB* core = sched_lock_thread(tcb);
 
-/*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
+	int queued = (tcb->state == READY && tcb->phase == CTX_CLEAN);
+	if (queued)
+		sched_queue_remove(core, tcb);
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
+	tcb->base_priority = priority;
 
-  Both of these structures are protected by @c sched_spinlock.
-*/
+	/* A thread keeps the priority it inherited, if that is higher */
+	int level = mlfq_clamp(tcb, priority - nice_levels(tcb));
+	if (tcb->pi_saved >= 0 && level < tcb->priority)
+		tcb->pi_saved = level;
+	else {
+		tcb->priority = level;
+		tcb->pi_saved = -1;
+	}
 
-rlnode SCHED[PRIORITY_QUEUES]; /* The scheduler queue */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+	if (queued)
+		sched_queue_add(core, tcb);
 
-/* Interrupt handler for ALARM */
-void yield_handler() { yield(SCHED_QUANTUM); }
+	Spinlock_Unlock(&core->sched_spinlock);
 
-/* Interrupt handle for inter-core interrupts */
-void ici_handler()
-{ /* noop for now... */
+	if (oldpre)
+		preempt_on;
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Note the level lent to a thread through a mutex it holds. If the thread
+  tracks too many mutexes already, the level is not noted, and it is given
+  back when the thread releases any contended mutex.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
+  *** MUST BE CALLED WITH the sched_spinlock of the core of the thread HELD ***
+ */
+static void pi_note_lock(TCB* tcb, Mutex* lock, int level)
 {
-	if (timeout != NO_TIMEOUT) {
-		/* set the wakeup time */
-		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+	for (int i = 0; i < tcb->pi_nlocks; i++)
+		if (tcb->pi_locks[i].lock == lock) {
+			if (tcb->pi_locks[i].level < level)
+				tcb->pi_locks[i].level = level;
+			return;
+		}
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
-	}
+	if (tcb->pi_nlocks < PI_LOCKS_MAX)
+		tcb->pi_locks[tcb->pi_nlocks++] = (pi_lock) { .lock = lock, .level = level };
 }
 
 /*
-  Add TCB to the end of the scheduler list.
+  Give back the levels a thread inherited through the mutexes it released,
+  and keep the highest level lent through the contended mutexes it still 
+  holds. A thread that released more mutexes than it can remember gives 
+  back every level. The mutexes released are not accessed, since they 
+  may be freed already.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static void sched_queue_add(TCB* tcb)
+  *** MUST BE CALLED WITH the sched_spinlock of the core of the thread HELD ***
+ */
+static void pi_give_back(TCB* tcb)
 {
-	assert(tcb->priority < PRIORITY_QUEUES);
-	assert(tcb->priority >= 0);
+	if (tcb->pi_nreleased > PI_LOCKS_MAX)
+		tcb->pi_nlocks = 0;
+	else
+		for (int r = 0; r < tcb->pi_nreleased; r++)
+			for (int i = 0; i < tcb->pi_nlocks; i++)
+				if (tcb->pi_locks[i].lock == tcb->pi_released[r]) {
+					tcb->pi_locks[i] = tcb->pi_locks[--tcb->pi_nlocks];
+					break;
+				}
+	tcb->pi_nreleased = 0;
+
+	if (tcb->pi_saved < 0)
+		return;
+
+	int level = tcb->pi_saved;
+	for (int i = 0; i < tcb->pi_nlocks; i++)
+		if (tcb->pi_locks[i].level > level)
+			level = tcb->pi_locks[i].level;
+
+	if (level > tcb->pi_saved)
+		tcb->priority = level;
+	else {
+		tcb->priority = tcb->pi_saved;
+		tcb->pi_saved = -1;
+	}
+}
 
-	/* Insert at the end of the specified scheduling list */
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
+/*
+  Raise the MLFQ level of the owner of a mutex to the given level. A 
+  queued thread is moved to its new level.
+
+  The lock of the core of the owner is only tried: this is called by a 
+  waiter about to give up its core, and it calls again each time it gives
+  up its core while it waits, so a raise that is skipped because the core
+  is busy is only late. Spinning here would make every waiter contend for
+  the lock of a remote core.
+
+  The TCB may have been recycled for a new thread since we read the mutex 
+  word, so we check again that it owns the mutex. While we hold the lock of
+  its core, the thread cannot exit and be released.
+ */
+static void sched_raise_priority(Mutex* lock, TCB* tcb, int level)
+{
+	CCB* core = __atomic_load_n(&tcb->core, __ATOMIC_ACQUIRE);
+	if (!Spinlock_TryLock(&core->sched_spinlock))
+		return;
+
+	if (core == tcb->core && tcb->state != EXITED
+		&& MUTEX_OWNER(__atomic_load_n(lock, __ATOMIC_SEQ_CST)) == tcb) {
+		/* The owner keeps the level while it holds the mutex, even if it is higher already */
+		pi_note_lock(tcb, lock, level);
+
+		if (tcb->priority < level) {
+			int queued = (tcb->state == READY && tcb->phase == CTX_CLEAN);
+			if (queued)
+				sched_queue_remove(core, tcb);
+
+			if (tcb->pi_saved < 0)
+				tcb->pi_saved = tcb->priority;
+			tcb->priority = level;
+
+			if (queued)
+				sched_queue_add(core, tcb);
+		}
+	}
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+	Spinlock_Unlock(&core->sched_spinlock);
 }
 
 /*
-	Adjust the state of a thread to make it READY.
-
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
+  The owner in the word of a mutex may exit and be released at any time 
+  after it unlocks the mutex, so we announce the epoch we read it in; its
+  block is not freed until we are done (see retire_thread_block). A TCB 
+  that is only cached for reuse may be recycled meanwhile; 
+  sched_raise_priority() checks the owner again. An owner that exits 
+  without unlocking the mutex is a bug of the program.
  */
-static void sched_make_ready(TCB* tcb)
+void sched_inherit_priority(Mutex* lock)
 {
-	assert(tcb->state == STOPPED || tcb->state == INIT);
+	if (sched_policy_class != &mlfq_class)
+		return;
 
-	/* Possibly remove from TIMEOUT_LIST */
-	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
-		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
-		tcb->wakeup_time = NO_TIMEOUT;
-	}
+	int oldpre = preempt_off;
+	CCB* core = &CURCORE;
+	TCB* self = core->current_thread;
 
-	/* Mark as ready */
-	tcb->state = READY;
+	__atomic_store_n(&core->pi_epoch, __atomic_load_n(&pi_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	Mutex word = __atomic_load_n(lock, __ATOMIC_SEQ_CST);
+	TCB* owner = MUTEX_OWNER(word);
+	if ((word & MUTEX_CONTENDED) && owner != NULL && owner != self)
+		sched_raise_priority(lock, owner, self->priority);
+	__atomic_store_n(&core->pi_epoch, 0, __ATOMIC_SEQ_CST);
 
-	/* Possibly add to the scheduler queue */
-	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
+	if (oldpre)
+		preempt_on;
 }
 
-/*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
-
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static void sched_wakeup_expired_timeouts()
+void sched_release_priority(Mutex* lock)
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
-
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
-		sched_make_ready(tcb);
+	int oldpre = preempt_off;
+	TCB* self = CURCORE.current_thread;
+	if (self != NULL) {
+		if (self->pi_nreleased < PI_LOCKS_MAX)
+			self->pi_released[self->pi_nreleased] = lock;
+		self->pi_nreleased++;
 	}
+	if (oldpre)
+		preempt_on;
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
-
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static TCB* sched_queue_select(TCB* current)
+  Set the affinity of a thread. A thread on a core which is excluded is
+  moved: a queued thread right away, a running thread when it leaves 
+  the core (which is interrupted), and a blocked thread when it wakes up.
+ */
+int sched_set_affinity(TCB* tcb, cpumask_t mask)
 {
-	int i = PRIORITY_QUEUES-1;
-	while(is_rlist_empty(&SCHED[i])){
-		i--;
+	mask = cpumask_and(mask, sched_all_cores());
+	if (cpumask_empty(mask))
+		return -1;
 
-		if(i<0) break;
+	int oldpre = preempt_off;
+	CCB* core = sched_lock_thread(tcb);
+
+	/* A real-time thread cannot leave the core it was admitted to */
+	if (tcb->rt_core != NULL && !cpumask_isset(&mask, tcb->rt_core->id)) {
+		Spinlock_Unlock(&core->sched_spinlock);
+		if (oldpre)
+			preempt_on;
+		return -1;
 	}
 
-  /* Initializing */
-	rlnode* sel = NULL;
-	TCB* next_thread = NULL; /* When the list is empty, this will remain NULL */
+	tcb->affinity = mask;
 
-	/* Get the head of the SCHED list if non-Empty is found */
-	if(i >= 0){
-		sel = rlist_pop_front(&SCHED[i]);
-		next_thread = sel->tcb;
+	int migrating = 0;
+	if (!sched_core_allowed(core, tcb)) {
+		if (tcb->state == READY && tcb->phase == CTX_CLEAN) {
+			sched_queue_remove(core, tcb);
+			tcb->state = STOPPED;
+			migrating = 1;
+		} else if (tcb->state == RUNNING || tcb->state == READY)
+			cpu_ici(core->id);
 	}
 
-  /* In case all lists are empty the next thread will be the idle_thread*/
-	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+	Spinlock_Unlock(&core->sched_spinlock);
 
-	next_thread->its = QUANTUM;
+	if (migrating)
+		wakeup(tcb);
 
-	return next_thread;
+	if (oldpre)
+		preempt_on;
+
+	return 0;
+}
+
+cpumask_t sched_get_affinity(TCB* tcb)
+{
+	return cpumask_and(tcb->affinity, sched_all_cores());
 }
 
 /*
-  Make the process ready.
+  Admit a density to a core of the affinity of a thread, preferably the 
+  core it was admitted to, then the given core. Return the core, or NULL
+  if no core has enough bandwidth left. The previous admission of the 
+  thread is given back.
  */
-int wakeup(TCB* tcb)
+static CCB* sched_rt_place(TCB* tcb, CCB* core, unsigned long density)
 {
-	int ret = 0;
+	CCB* target = NULL;
 
-	/* Preemption off */
-	int oldpre = preempt_off;
+	if (tcb->rt_core != NULL && cpumask_isset(&tcb->affinity, tcb->rt_core->id)
+		&& sched_rt_admit(tcb->rt_core, tcb->rt_density, density))
+		return tcb->rt_core;
 
-	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	if (cpumask_isset(&tcb->affinity, core->id) && sched_rt_admit(core, 0, density))
+		target = core;
+	for (uint c = 0; target == NULL && c < cpu_cores(); c++)
+		if (cpumask_isset(&tcb->affinity, c) && sched_rt_admit(&cctx[c], 0, density))
+			target = &cctx[c];
 
-	if (tcb->state == STOPPED || tcb->state == INIT) {
-		sched_make_ready(tcb);
-		ret = 1;
+	if (target != NULL && tcb->rt_core != NULL)
+		sched_rt_admit(tcb->rt_core, tcb->rt_density, 0);
+	return target;
+}
+
+/*
+  Set the real-time parameters of a thread. A queued thread is moved
+  to the run queue of its new class, on the core it was admitted to.
+  A running thread moves when it leaves its core (which is interrupted).
+ */
+int sched_set_rt(TCB* tcb, TimerDuration runtime, TimerDuration period, TimerDuration deadline)
+{
+	if (deadline == 0)
+		deadline = period;
+	if (runtime != 0 && (runtime < RT_RUNTIME_MIN || runtime > deadline || deadline > period))
+		return -1;
+
+	unsigned long density = (runtime != 0) ? runtime * 1000000ul / deadline : 0;
+
+	int oldpre = preempt_off;
+	CCB* core = sched_lock_thread(tcb);
+
+	CCB* rt_core = NULL;
+	if (density == 0) {
+		if (tcb->rt_core != NULL)
+			sched_rt_admit(tcb->rt_core, tcb->rt_density, 0);
+	} else if ((rt_core = sched_rt_place(tcb, core, density)) == NULL) {
+		Spinlock_Unlock(&core->sched_spinlock);
+		if (oldpre)
+			preempt_on;
+		return -1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	int queued = (tcb->state == READY && tcb->phase == CTX_CLEAN);
+	if (queued)
+		sched_queue_remove(core, tcb);
+
+	tcb->rt_runtime = runtime;
+	tcb->rt_period = period;
+	tcb->rt_rel_deadline = deadline;
+	tcb->rt_density = density;
+	tcb->rt_core = rt_core;
+
+	/* The first period starts when the thread is next queued or charged */
+	tcb->rt_budget = 0;
+	tcb->rt_deadline = NO_TIMEOUT;
+	tcb->rt_period_end = 0;
+
+	int migrating = 0;
+	if (queued) {
+		if (sched_core_allowed(core, tcb))
+			sched_queue_add(core, tcb);
+		else {
+			tcb->state = STOPPED;
+			migrating = 1;
+		}
+	} else if (!sched_core_allowed(core, tcb) && (tcb->state == RUNNING || tcb->state == READY))
+		cpu_ici(core->id);
+
+	Spinlock_Unlock(&core->sched_spinlock);
+
+	if (migrating)
+		wakeup(tcb);
 
-	/* Restore preemption state */
 	if (oldpre)
 		preempt_on;
 
-	return ret;
+	return 0;
 }
 
 /*
@@ -395,22 +1921,30 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 
 	int preempt = preempt_off;
-	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	CCB* core = &CURCORE;
+	TCB* tcb = core->current_thread;
+	Spinlock_Lock(&core->sched_spinlock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
 
+	/* an exiting real-time thread gives back its bandwidth */
+	if (state == EXITED && tcb->rt_core != NULL) {
+		sched_rt_admit(tcb->rt_core, tcb->rt_density, 0);
+		tcb->rt_density = 0;
+		tcb->rt_core = NULL;
+	}
+
 	/* register the timeout (if any) for the sleeping thread */
 	if (state != EXITED)
-		sched_register_timeout(tcb, timeout);
+		sched_register_timeout(core, tcb, timeout);
 
 	/* Release mx */
 	if (mx != NULL)
 		Mutex_Unlock(mx);
 
 	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+	Spinlock_Unlock(&core->sched_spinlock);
 
 	/* call this to schedule someone else */
 	yield(cause);
@@ -421,7 +1955,6 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 }
 
 /* This function is the entry point to the scheduler's context switching */
-int yield_counter = 0;
 void yield(enum SCHED_CAUSE cause)
 {
 	/* Reset the timer, so that we are not interrupted by ALARM */
@@ -430,71 +1963,64 @@ void yield(enum SCHED_CAUSE cause)
 	/* We must stop preemption but save it! */
 	int preempt = preempt_off;
 
-	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
+	CCB* core = &CURCORE;
+	TCB* current = core->current_thread; /* Make a local copy of current process, for speed */
 
-	Mutex_Lock(&sched_spinlock);
+	Spinlock_Lock(&core->sched_spinlock);
 
 	/* Update CURTHREAD state */
 	if (current->state == RUNNING)
 		current->state = READY;
 
+	/* A thread that released a contended lock gives back the priority it inherited through it */
+	if (current->pi_nreleased > 0)
+		pi_give_back(current);
+
 	/* Update CURTHREAD scheduler data */
 	current->rts = remaining;
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
 
-  /* checking the yield cause and acting accordingly*/
-  switch (cause){
-  	case SCHED_QUANTUM:
-  	  if(current->priority > 0)
-  			current->priority--;
-  	  break;
-  	case SCHED_IO:
-  	  if(current->priority < PRIORITY_QUEUES-1)
-  	  	current->priority++;
-  	  break;
-  	case SCHED_MUTEX:
-  		if(current->last_cause == current->curr_cause && current->priority > 0)
-  			current->priority--;
-  		break;
-  	default:
-  		break;
-  }
-  
+	/* Let the class of the thread account for the time slice */
+	if (current->type != IDLE_THREAD) {
+		if (cause == SCHED_QUANTUM)
+			sched_class_of(current)->on_tick(core, current);
+		else
+			sched_class_of(current)->on_block(core, current, cause);
+	}
+
 	/* Wake up threads whose sleep timeout has expired */
-	sched_wakeup_expired_timeouts();
-
-	/* increasing counter and checking if it is ready to boost*/
-  yield_counter++;
-  if(yield_counter == MAX_YIELDS){
-  	rlnode* temporary_node = NULL;
-
-    /* it starts at the second highest priority queue increasing
-     * its threads priorities by one, we do the same for all the rest queues */ 
-  	for(int i = PRIORITY_QUEUES-2; i >= 0; i--){
-  		while(!is_rlist_empty(&SCHED[i])){
-  			temporary_node = rlist_pop_front(&SCHED[i]);
-  			rlist_push_back(&SCHED[i+1], temporary_node);
-  			if(temporary_node->tcb->priority < PRIORITY_QUEUES-1)
-  				temporary_node->tcb->priority++;
-  		}
-  	}
-  	/* initializing the yield counter */
-  	yield_counter = 0;
-  }
+	sched_wakeup_expired_timeouts(core);
+
+	/* Release throttled real-time threads whose period has ended */
+	edf_release_throttled(core);
+
+	/* Keep track of the load */
+	sched_update_util(core, current);
+	if (cause == SCHED_QUANTUM)
+		sched_balance(core, current);
+
+	/* Adapt the time slice to the contention for the core */
+	if (current->type != IDLE_THREAD)
+		sched_adapt_slice(core, current, cause);
 
 	/* Get next */
-	TCB* next = sched_queue_select(current);
+	TCB* next = sched_queue_select(core, current);
 	assert(next != NULL);
 
 	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
+	core->previous_thread = current;
 
-	Mutex_Unlock(&sched_spinlock);
+	/* An idle core is restarted when a thread is added to its queue */
+	core->idle = (next == &core->idle_thread);
+	if (core->idle)
+		sched_check_park(core, current);
+
+	Spinlock_Unlock(&core->sched_spinlock);
 
 	/* Switch contexts */
 	if (current != next) {
-		CURTHREAD = next;
+		core->current_thread = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
 
@@ -520,9 +2046,12 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
+	/* We may be running on a different core than the one we yielded on */
+	CCB* core = &CURCORE;
+
+	Spinlock_Lock(&core->sched_spinlock);
 
-	TCB* current = CURTHREAD;
+	TCB* current = core->current_thread;
 
 	/* Mark current state */
 	current->state = RUNNING;
@@ -530,16 +2059,26 @@ void gain(int preempt)
 	current->rts = current->its;
 
 	/* Take care of the previous thread */
-	TCB* prev = CURCORE.previous_thread;
+	TCB* prev = core->previous_thread;
+	TCB* migrating = NULL;
+	TCB* exited = NULL;
 	if (current != prev) {
 		prev->phase = CTX_CLEAN;
 		switch (prev->state) {
 		case READY:
-			if (prev->type != IDLE_THREAD)
-				sched_queue_add(prev);
+			if (prev->type == IDLE_THREAD)
+				break;
+			if (sched_core_allowed(core, prev))
+				sched_queue_add(core, prev);
+			else {
+				/* Its affinity changed, it is woken up on another core below */
+				prev->state = STOPPED;
+				migrating = prev;
+			}
 			break;
 		case EXITED:
-			release_TCB(prev);
+			/* It is released below, without the lock */
+			exited = prev;
 			break;
 		case STOPPED:
 			break;
@@ -548,14 +2087,46 @@ void gain(int preempt)
 		}
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	/* 
+		The idle thread only needs to wake up for the next timeout, or to 
+		check whether its core can be parked. Also, the
+		core must be interrupted when a throttled real-time thread is released.
+	*/
+	TimerDuration alarm = current->rts;
+	TimerDuration deadline = edf_next_release(core);
+	if (current->type == IDLE_THREAD) {
+		TimerDuration timeout = sched_next_timeout(core);
+		if (timeout < deadline)
+			deadline = timeout;
+		timeout = sched_park_time(core);
+		if (timeout < deadline)
+			deadline = timeout;
+		alarm = NO_TIMEOUT;
+	}
+	if (deadline != NO_TIMEOUT) {
+		TimerDuration curtime = bios_clock();
+		deadline = (deadline > curtime + TIMEOUT_WHEEL_TICK) ? deadline - curtime : TIMEOUT_WHEEL_TICK;
+		if (deadline < alarm)
+			alarm = deadline;
+	}
+
+	Spinlock_Unlock(&core->sched_spinlock);
+
+	if (exited != NULL)
+		release_TCB(exited);
+
+	if (migrating != NULL)
+		wakeup(migrating);
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
 
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
+	/* Set a 1-quantum alarm (or none, for an idle core without timeouts) */
+	if (alarm == NO_TIMEOUT)
+		bios_cancel_timer();
+	else
+		bios_set_timer(alarm);
 }
 
 static void idle_thread()
@@ -564,8 +2135,22 @@ static void idle_thread()
 	yield(SCHED_IDLE);
 
 	/* We come here whenever we cannot find a ready thread for our core */
+	CCB* core = &CURCORE;
 	while (active_threads > 0) {
-		cpu_core_halt();
+		if (__atomic_load_n(&core->parked, __ATOMIC_ACQUIRE)) {
+			cpu_core_park();
+
+			/* We were unparked, or a thread was added to our queue */
+			int oldpre = preempt_off;
+			Spinlock_Lock(&core->sched_spinlock);
+			core->parked = 0;
+			core->idle_since = bios_clock();
+			SCHED_STAT(core, unparks, 1);
+			Spinlock_Unlock(&core->sched_spinlock);
+			if (oldpre)
+				preempt_on;
+		} else
+			cpu_core_halt();
 		yield(SCHED_IDLE);
 	}
 
@@ -575,14 +2160,50 @@ static void idle_thread()
 }
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues of every core
  */
-void initialize_scheduler()
+void initialize_scheduler(sched_policy policy)
 {
-	for(int i=0; i < PRIORITY_QUEUES; i++)
-		rlnode_init(&SCHED[i], NULL);
+	switch (policy) {
+	case SCHED_POLICY_CFS:
+		sched_policy_class = &cfs_class;
+		break;
+	case SCHED_POLICY_RR:
+		sched_policy_class = &rr_class;
+		break;
+	default:
+		sched_policy_class = &mlfq_class;
+	}
+
+	for (uint c = 0; c < MAX_CORES; c++) {
+		CCB* core = &cctx[c];
+		core->id = c;
+		core->idle = 0;
+		core->handoff = NULL;
+
+		sched_policy_class->init(core);
+		edf_class.init(core);
+		for (int i = 0; i < TIMEOUT_WHEEL_SLOTS; i++)
+			rlnode_init(&core->timeout_wheel[i], NULL);
+		core->wheel_tick = bios_clock() / TIMEOUT_WHEEL_TICK;
+
+		core->ready_count = 0;
+		core->rt_bandwidth = 0;
+		core->util = 0;
+		core->util_stamp = core->last_balance = core->idle_since = bios_clock();
+		core->parked = 0;
+#if defined(SCHED_STATISTICS)
+		core->stats = (sched_stats) { 0 };
+#endif
+		core->sched_spinlock = SPINLOCK_INIT;
 
-	rlnode_init(&TIMEOUT_LIST, NULL);
+		rlnode_init(&core->thread_cache, NULL);
+		core->thread_cache_size = 0;
+		rlnode_init(&core->thread_retired, NULL);
+		core->pi_epoch = 0;
+	}
+	rlnode_init(&thread_pool, NULL);
+	thread_pool_size = 0;
 }
 
 void run_scheduler()
@@ -599,6 +2220,12 @@ void run_scheduler()
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.core = curcore;
+	curcore->idle_thread.affinity = CPUMASK_ALL;
+	curcore->idle_thread.rt_core = NULL;
+	curcore->idle_thread.pi_saved = -1;
+	curcore->idle_thread.pi_nlocks = 0;
+	curcore->idle_thread.pi_nreleased = 0;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
 	curcore->idle_thread.its = QUANTUM;
@@ -619,4 +2246,14 @@ void run_scheduler()
 	assert(CURTHREAD == &CURCORE.idle_thread);
 	cpu_interrupt_handler(ALARM, NULL);
 	cpu_interrupt_handler(ICI, NULL);
+
+	/* All threads have been released */
+	thread_cache_drain(curcore);
+
+#if defined(SCHED_STATISTICS)
+	sched_stats* st = &curcore->stats;
+	fprintf(stderr, "Core %3u: steals=%lu migrations=%lu balances=%lu avg(imbalance)=%.2lf parks=%lu unparks=%lu\n",
+		curcore->id, st->steals, st->migrations, st->balances,
+		st->balances ? (double)st->imbalance / st->balances : 0.0, st->parks, st->unparks);
+#endif
 }
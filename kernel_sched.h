@@ -88,12 +88,34 @@ enum SCHED_CAUSE {
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
-	SCHED_USER /**< @brief User-space code called yield */
+	SCHED_USER, /**< @brief User-space code called yield */
+	SCHED_PREEMPT, /**< @brief A real-time thread with an earlier deadline became ready */
+	SCHED_FUTEX /**< @brief Sleep at a locked @c SleepMutex */
 };
 
 
 #define MAX_YIELDS 2000
-#define PRIORITY_QUEUES 5
+#define PRIORITY_QUEUES (THREAD_PRIORITY_MAX + 1)
+
+/** @brief The nice values per MLFQ level of bias.
+
+  A thread of a process with a nice value of @c n starts @c n / @c NICE_PER_LEVEL 
+  levels below its priority. Also, if @c n is positive, the thread never rises
+  to the top @c n / @c NICE_PER_LEVEL levels and, if it is negative, it never 
+  drops to the bottom -@c n / @c NICE_PER_LEVEL levels.
+ */
+#define NICE_PER_LEVEL 8
+
+/** @brief The number of contended mutexes, held by a thread, whose inherited 
+  MLFQ levels the thread keeps track of. */
+#define PI_LOCKS_MAX 4
+
+/** @brief A contended mutex held by a thread, and the highest MLFQ level its 
+  waiters lent to the thread */
+typedef struct pi_lock {
+	Mutex* lock;
+	int level;
+} pi_lock;
 
 /**
   @brief The thread control block
@@ -107,8 +129,19 @@ typedef struct thread_control_block {
 
   PTCB* ptcb; /**< @brief Paired ptcb */
   int priority; /**< @brief In order to make a Multi-Level Feedback Queue Scheduler */
+  int base_priority; /**< @brief The priority set by the user, which @c priority starts from */
+  unsigned int slice_shift; /**< @brief The time slice of the thread is grown by 2 to this power */
+  int pi_saved; /**< @brief The priority of the thread before it inherited a higher one, or -1 */
+  pi_lock pi_locks[PI_LOCKS_MAX]; /**< @brief The contended mutexes held, which the thread inherited a level through */
+  int pi_nlocks; /**< @brief The number of entries of @c pi_locks */
+  Mutex* pi_released[PI_LOCKS_MAX]; /**< @brief Contended mutexes released, whose inherited levels the 
+                                         thread gives back when it next yields */
+  int pi_nreleased; /**< @brief The number of contended mutexes released (it may exceed 
+                         @c PI_LOCKS_MAX, and then all inherited levels are given back) */
+  unsigned long retire_epoch; /**< @brief For a block waiting to be freed, the epoch it was retired in */
 
 	cpu_context_t context; /**< @brief The thread context */
+	size_t stack_size; /**< @brief The size of the thread stack, which lies below the TCB */
 	Thread_type type; /**< @brief The type of thread */
 	Thread_state state; /**< @brief The state of the thread */
 	Thread_phase phase; /**< @brief The phase of the thread */
@@ -118,6 +151,25 @@ typedef struct thread_control_block {
 	TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
 
 	rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
+	avl_node sched_tree_node; /**< @brief Node to use in the run queue of the CFS policy */
+	unsigned long vruntime; /**< @brief Virtual run time (in microseconds) of the CFS policy */
+
+	TimerDuration rt_runtime; /**< @brief Real-time budget per period, 0 for a normal thread */
+	TimerDuration rt_period; /**< @brief Real-time period */
+	TimerDuration rt_rel_deadline; /**< @brief Real-time deadline, relative to the start of a period */
+	TimerDuration rt_budget; /**< @brief The budget left in the current period */
+	TimerDuration rt_deadline; /**< @brief The absolute deadline of the current period */
+	TimerDuration rt_period_end; /**< @brief The end of the current period */
+	unsigned long rt_density; /**< @brief The admitted bandwidth (@c rt_runtime / @c rt_rel_deadline, 
+	                               in parts per million) */
+	CCB* rt_core; /**< @brief The core a real-time thread was admitted to, and the only core 
+	                   it runs on, or NULL */
+	unsigned int rt_misses; /**< @brief Number of periods whose deadline was missed */
+	int rt_missed; /**< @brief Set when the deadline of the current period was missed */
+	CCB* core; /**< @brief The core whose run queue this thread belongs to (and the core
+	                it last ran on) */
+	cpumask_t affinity; /**< @brief The cores this thread may run on */
+	unsigned long boost_epoch; /**< @brief The boost epoch of @c core when this thread was queued */
 	TimerDuration its; /**< @brief Initial time-slice for this thread */
 	TimerDuration rts; /**< @brief Remaining time-slice for this thread */
 
@@ -157,16 +209,102 @@ typedef struct process_thread_control_block{
 
 /** @brief Thread stack size.
 
-  The default thread stack size in TinyOS is 128 kbytes.
+  The default thread stack size in TinyOS is 128 kbytes. Stack pages are
+  only committed to memory as they are used.
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief Thread cache watermarks.
+
+  Each core keeps a cache of free thread blocks (TCB and stack). When
+  the cache grows beyond @c THREAD_CACHE_HIGH blocks, it is trimmed to
+  @c THREAD_CACHE_LOW blocks by moving blocks to a global pool. When
+  it is empty, it is refilled with up to @c THREAD_CACHE_LOW blocks 
+  from the global pool.
+ */
+#define THREAD_CACHE_HIGH 64
+#define THREAD_CACHE_LOW 16
+
+/** @brief The maximum number of blocks in the global thread pool. 
+  
+  Blocks beyond this are returned to the allocator. 
+ */
+#define THREAD_POOL_MAX 1024
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/** @brief Number of slots in the timeout wheel of each core. */
+#define TIMEOUT_WHEEL_SLOTS 256
+
+/** @brief The time span (in microseconds) of a slot of the timeout wheel. */
+#define TIMEOUT_WHEEL_TICK 1000
+
+/** @brief The real-time bandwidth of each core, in parts per million.
+
+  A real-time thread is admitted to a core, as long as the total density
+  (runtime over deadline) of the real-time threads of the core does not
+  exceed this bandwidth, so that the other threads are not starved.
+ */
+#define RT_BANDWIDTH 900000
+
+/** @brief The minimum runtime (in microseconds) of a real-time thread. */
+#define RT_RUNTIME_MIN 1000
+
+/** @brief Define this to keep scheduler statistics for each core,
+  which are printed when the scheduler stops. */
+#if 0
+#define SCHED_STATISTICS
+#endif
+
+/** @brief Scheduler statistics of a core. */
+typedef struct sched_stats {
+	unsigned long steals; /**< @brief Threads stolen by this idle core */
+	unsigned long migrations; /**< @brief Threads moved to this core by the balancer or at wakeup */
+	unsigned long balances; /**< @brief Runs of the balancer on this core */
+	unsigned long imbalance; /**< @brief Total excess load of the busiest core seen by the balancer */
+	unsigned long parks; /**< @brief Times this core was parked */
+	unsigned long unparks; /**< @brief Times this core was unparked */
+} sched_stats;
+
+/** @brief The minimum time (in microseconds) between two runs of the balancer on a core. */
+#define SCHED_BALANCE_INTERVAL (2 * QUANTUM)
+
+/** @brief The utilisation of a busy core. */
+#define SCHED_UTIL_SCALE 1024
+
+/** @brief The time (in microseconds) over which the utilisation of a core is averaged. */
+#define SCHED_UTIL_PERIOD (10 * QUANTUM)
+
+/** @brief The time (in microseconds) that a core must be idle before it is parked. */
+#define SCHED_PARK_DELAY SCHED_UTIL_PERIOD
+
+/** @brief A core is only parked if its utilisation is below this. */
+#define SCHED_PARK_UTIL (SCHED_UTIL_SCALE / 8)
+
+/** @brief A busy core unparks a core when it has this many ready threads. */
+#define SCHED_UNPARK_DEPTH 2
+
+/** @brief A fair spinlock, for the locks of the scheduler.
+
+  This is a ticket lock: each core takes a ticket and waits until the 
+  lock serves its ticket, so the lock is acquired in FIFO order. 
+  Unlike a @c Mutex, it never yields, so it must only be held with 
+  preemption off.
+
+  @see Spinlock_Lock
+ */
+typedef struct spinlock {
+	unsigned int next;     /**< @brief The next ticket to hand out */
+	unsigned int serving;  /**< @brief The ticket that holds the lock */
+} Spinlock;
+
+/** @brief Initial value for an unlocked spinlock. */
+#define SPINLOCK_INIT ((Spinlock){ 0, 0 })
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
@@ -178,12 +316,83 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	rlnode ready_queue[PRIORITY_QUEUES]; /**< @brief The MLFQ run queues of this core (the RR 
+	                                          policy only uses the first) */
+	unsigned int ready_bitmap; /**< @brief Bit @c i is set iff MLFQ level @c i is not empty */
+	unsigned int queue_offset; /**< @brief Rotation of the MLFQ levels in @c ready_queue */
+	unsigned long boost_epoch; /**< @brief The number of priority boosts of this core */
+	rlnode timeout_wheel[TIMEOUT_WHEEL_SLOTS]; /**< @brief Threads sleeping on this core with 
+	                                               a timeout, hashed by wakeup tick */
+	TimerDuration wheel_tick; /**< @brief The earliest tick of @c timeout_wheel not yet expired */
+	unsigned int ready_count; /**< @brief Number of threads that can run now, in the run 
+	                               queues (throttled real-time threads are not counted) */
+	int yield_counter; /**< @brief Yields since the last priority boost */
+	avl_tree timeline; /**< @brief The CFS run queue, ordered by @c vruntime */
+	unsigned long min_vruntime; /**< @brief The CFS virtual time of this core */
+	avl_tree rt_timeline; /**< @brief The real-time run queue, ordered by @c rt_deadline */
+	rlnode rt_throttled; /**< @brief Real-time threads that used up their budget for this period */
+	unsigned long rt_bandwidth; /**< @brief The total density of the real-time threads admitted 
+	                                 to this core, in parts per million */
+	TimerDuration curr_deadline; /**< @brief The deadline of the thread selected to run, or 
+	                                  @c NO_TIMEOUT if it is not a real-time thread */
+	int idle; /**< @brief Set when the core has selected its idle thread (and may halt) */
+	TCB* handoff; /**< @brief A thread in @c ready_queue to run next, if the current thread blocks */
+
+	unsigned int util; /**< @brief Recent utilisation, from 0 (idle) to @c SCHED_UTIL_SCALE (busy) */
+	TimerDuration util_stamp; /**< @brief The time @c util was last updated */
+	TimerDuration last_balance; /**< @brief The time the balancer last ran on this core */
+	TimerDuration idle_since; /**< @brief The time this core became idle (or last failed to park) */
+	int parked; /**< @brief Set when the core is (about to be) parked */
+#if defined(SCHED_STATISTICS)
+	sched_stats stats; /**< @brief Scheduler statistics */
+#endif
+
+	rlnode thread_cache; /**< @brief Free thread blocks of this core */
+	unsigned int thread_cache_size; /**< @brief Number of blocks in @c thread_cache */
+	rlnode thread_retired; /**< @brief Blocks of exited threads to be freed, once no core may read them */
+	unsigned long pi_epoch; /**< @brief The epoch this core reads the owner of a mutex in, or 0 */
+
+	Spinlock sched_spinlock; /**< @brief Protects the queues of this core and the 
+	                           state of the threads whose @c core is this core */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
 extern CCB cctx[MAX_CORES];
 
 
+/** @brief A scheduling policy.
+
+  The scheduler delegates the management of the run queue of each core 
+  to a scheduling policy. All these functions are called with the
+  @c sched_spinlock of the core held.
+ */
+typedef struct sched_class {
+	const char* name; /**< @brief The name of the policy */
+
+	/** @brief Initialize the run queue of a core */
+	void (*init)(CCB* core);
+
+	/** @brief Add a @c READY thread to the run queue of the core */
+	void (*enqueue)(CCB* core, TCB* tcb);
+
+	/** @brief Remove the given thread from the run queue of the core */
+	void (*dequeue)(CCB* core, TCB* tcb);
+
+	/** @brief Remove and return the thread to run next, or NULL if the run queue is empty */
+	TCB* (*pick_next)(CCB* core);
+
+	/** @brief The thread running on the core used up its quantum */
+	void (*on_tick)(CCB* core, TCB* tcb);
+
+	/** @brief The thread running on the core left it before its quantum expired */
+	void (*on_block)(CCB* core, TCB* tcb, enum SCHED_CAUSE cause);
+
+	/** @brief The time slice of a thread, before it is scaled by the nice value */
+	TimerDuration (*quantum)(TCB* tcb);
+} sched_class;
+
+
 /** 
   @brief The current thread.
 
@@ -227,6 +436,17 @@ TCB* cur_thread();
 */
 TCB* spawn_thread(PCB* pcb, void (*func)());
 
+/**
+	@brief Create a new thread with the given stack size.
+
+	This is the same as @c spawn_thread(), except that the thread stack
+	will be @c stack_size bytes (rounded up to a multiple of the page size),
+	instead of @c THREAD_STACK_SIZE.
+
+	@see spawn_thread
+*/
+TCB* spawn_thread_stack(PCB* pcb, void (*func)(), size_t stack_size);
+
 /**
   @brief Wakeup a blocked thread.
 
@@ -239,6 +459,104 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup a blocked thread, handing the core off to it.
+
+  This is the same as @c wakeup(), except that the thread is moved to the 
+  current core, and it will be the next thread to run on the core if the 
+  current thread blocks soon (i.e., before the next scheduling decision
+  on this core). This is useful when the current thread is about to wait 
+  for the woken thread, as in a producer/consumer pair.
+
+  @param tcb the thread to be made @c READY.
+  @returns 1 if the thread state was @c STOPPED or @c INIT, 0 otherwise
+  @see wakeup
+*/
+int wakeup_handoff(TCB* tcb);
+
+/**
+  @brief Set the priority of a thread.
+
+  This sets the base priority of the thread, and moves its current MLFQ
+  level there (biased by the nice value of its process).
+
+  @param tcb the thread, which must not have exited
+  @param priority the priority, between @c THREAD_PRIORITY_MIN and @c THREAD_PRIORITY_MAX
+ */
+void sched_set_priority(TCB* tcb, int priority);
+
+/**
+  @brief Lend the priority of the current thread to the owner of a mutex.
+
+  If the mutex is locked and contended, and its owner is at a lower MLFQ 
+  level than the current thread, the owner is raised to the level of the 
+  current thread, until it releases this mutex and it holds no other 
+  contended mutex lending it that level. This is best-effort: it is 
+  skipped if the core of the owner is busy.
+
+  @param lock the mutex the current thread waits for
+  @see sched_release_priority
+ */
+void sched_inherit_priority(Mutex* lock);
+
+/**
+  @brief The current thread released a contended lock.
+
+  The current thread gives back the level it inherited through @c lock, 
+  when it next yields, keeping the highest level lent through the other
+  contended mutexes it holds. (Its priority only matters when it is queued.)
+
+  @param lock the mutex released
+ */
+void sched_release_priority(Mutex* lock);
+
+/**
+  @brief Set the affinity of a thread.
+
+  The thread will only run on the cores in @c mask (ignoring cores that 
+  do not exist). If it is on some other core, it is moved. A real-time 
+  thread keeps running on the core it was admitted to, which @c mask 
+  must contain.
+
+  @param tcb the thread, which must not have exited
+  @param mask the cores the thread may run on
+  @returns 0 on success, or -1 if @c mask contains no core, or if it 
+    excludes the core of a real-time thread.
+ */
+int sched_set_affinity(TCB* tcb, cpumask_t mask);
+
+/**
+  @brief Return the affinity of a thread.
+
+  @param tcb the thread, which must not have exited
+  @returns the cores the thread may run on
+ */
+cpumask_t sched_get_affinity(TCB* tcb);
+
+/**
+  @brief Set the real-time parameters of a thread.
+
+  A real-time thread gets @c runtime microseconds of CPU time in every 
+  period of @c period microseconds, and its deadline is @c deadline 
+  microseconds after the start of the period. Real-time threads are
+  scheduled earliest-deadline-first, before every other thread. A 
+  @c runtime of 0 makes @c tcb a normal thread again.
+
+  The thread is admitted to one of the cores of its affinity (preferably
+  the core it is on) that has enough real-time bandwidth left, and from 
+  then on it only runs on that core.
+
+  @param tcb the thread, which must not have exited
+  @param runtime the budget per period
+  @param period the period
+  @param deadline the relative deadline, or 0 for a deadline equal to the period
+  @returns 0 on success, or -1 if the parameters are invalid, or if
+    no core of the affinity of the thread has enough real-time bandwidth 
+    to admit it.
+  @see RT_BANDWIDTH
+ */
+int sched_set_rt(TCB* tcb, TimerDuration runtime, TimerDuration period, TimerDuration deadline);
+
 /** 
   @brief Block the current thread.
 
@@ -293,8 +611,9 @@ void run_scheduler(void);
   @brief Initialize the scheduler.
 
    This function is called during kernel initialization.
+   @param policy the scheduling policy to use
  */
-void initialize_scheduler(void);
+void initialize_scheduler(sched_policy policy);
 
 /**
   @brief Quantum (in microseconds) 
@@ -303,6 +622,18 @@ void initialize_scheduler(void);
   */
 #define QUANTUM (10000L)
 
+/** @brief Define this to grow the time slice of a thread that uses it up
+  while no other thread waits for its core. */
+#if 1
+#define SCHED_ADAPTIVE_QUANTUM
+#endif
+
+/** @brief The time slice of a thread grows up to 2 to this power times its quantum. */
+#define SCHED_SLICE_SHIFT_MAX 2
+
+/** @brief The longest time slice (in microseconds) of a thread. */
+#define SCHED_SLICE_MAX (8 * QUANTUM)
+
 /** @} */
 
 #endif
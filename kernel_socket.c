@@ -6,6 +6,13 @@
 
 socket_cb* PORT_MAP[MAX_PORT];
 
+/* 
+	Protects PORT_MAP, the queues of listeners and the connection requests.
+	The type of a socket changes with both this lock and the lock of 
+	the socket held, so it can be read under either lock.
+ */
+static Mutex port_map_lock = MUTEX_INIT;
+
 static file_ops socket_file_ops = {
 	.Read = socket_read,
 	.Write = socket_write,
@@ -19,22 +26,56 @@ socket_cb* init_socket(port_t port)
 	socket_cb* socket = (socket_cb*) xmalloc(sizeof(socket_cb));
 
 	/* initializing the fileds of the socket control block */
+	socket->lock = MUTEX_INIT;
 	socket->refcount = 0;
+	socket->closed = 0;
 	socket->type = SOCKET_UNBOUND;
 	socket->port = port;
 
 	return socket;
 }
 
+/* 
+	Return the socket of fid sock, or NULL if sock is not a socket.
+	The socket will not be freed until the caller calls socket_decref(), 
+	even if the fid is closed meanwhile.
+ */
+static socket_cb* get_socket(Fid_t sock)
+{
+	FCB* fcb = get_fcb_ref(sock);
+	if(fcb == NULL)
+		return NULL;
+
+	socket_cb* socket = NULL;
+	if(fcb->streamfunc == &socket_file_ops) {
+		socket = (socket_cb*) fcb->streamobj;
+		Mutex_Lock(&socket->lock);
+		socket->refcount++;
+		Mutex_Unlock(&socket->lock);
+	}
+
+	/* this may close the socket, but it will not free it */
+	FCB_decref(fcb);
+	return socket;
+}
+
+/* drop a reference taken by get_socket(), freeing the socket if it was closed */
+static void socket_decref(socket_cb* socket)
+{
+	Mutex_Lock(&socket->lock);
+	int last = (--socket->refcount == 0) && socket->closed;
+	Mutex_Unlock(&socket->lock);
+
+	if(last)
+		free(socket);
+}
+
 Fid_t sys_Socket(port_t port)
 {
 	/* checking if the port is illegal, below NOPORT or above MAX_PORT*/
 	if(port < NOPORT || port > MAX_PORT)
 		return NOFILE;
 
-	/* initializing socket_cb*/
-	socket_cb* socket = init_socket(port);
-
 	Fid_t fid_t;
 	FCB* fcb;
 
@@ -42,6 +83,9 @@ Fid_t sys_Socket(port_t port)
 	if(!FCB_reserve(1, &fid_t, &fcb))
 		return NOFILE;
 
+	/* initializing socket_cb*/
+	socket_cb* socket = init_socket(port);
+
 	/* Setting up the socket with its respective file_ops */
 	fcb->streamfunc = &socket_file_ops;
 	fcb->streamobj = socket;
@@ -55,24 +99,32 @@ int socket_read(void* socketcb_t, char *buf, unsigned int n)
 {
 	socket_cb* socket_reader = (socket_cb*) socketcb_t;
 
-	/* if the socket reader is null or if its type is not SOCKET_PEER then return -1*/
-	if(socket_reader == NULL || socket_reader->type != SOCKET_PEER)
+	if(socket_reader == NULL)
 		return -1;
 
-	/* returning the return_value of the pipe_read function*/
-	return pipe_read(socket_reader->peer.read, buf, n);
+	/* if the type of the socket reader is not SOCKET_PEER then return -1*/
+	Mutex_Lock(&socket_reader->lock);
+	pipe_cb* pipe = (socket_reader->type == SOCKET_PEER) ? socket_reader->peer.read : NULL;
+	Mutex_Unlock(&socket_reader->lock);
+
+	/* returning the return_value of the pipe_read function (pipes are never freed) */
+	return pipe_read(pipe, buf, n);
 }
 
 int socket_write(void* socketcb_t, const char *buf, unsigned int n)
 {
 	socket_cb* socket_writer = (socket_cb*) socketcb_t;
 
-	/* if the socket writer is null or if its type is not SOCKET_PEER then return -1*/
-	if(socket_writer == NULL || socket_writer->type != SOCKET_PEER)
+	if(socket_writer == NULL)
 		return -1;
 
-	/* returning the return_value of the pipe_write function*/
-	return pipe_write(socket_writer->peer.write, buf, n);
+	/* if the type of the socket writer is not SOCKET_PEER then return -1*/
+	Mutex_Lock(&socket_writer->lock);
+	pipe_cb* pipe = (socket_writer->type == SOCKET_PEER) ? socket_writer->peer.write : NULL;
+	Mutex_Unlock(&socket_writer->lock);
+
+	/* returning the return_value of the pipe_write function (pipes are never freed) */
+	return pipe_write(pipe, buf, n);
 }
 
 int socket_close(void* socketcb_t)
@@ -83,6 +135,9 @@ int socket_close(void* socketcb_t)
 	if(socket == NULL)
 		return -1;
 
+	Mutex_Lock(&port_map_lock);
+	Mutex_Lock(&socket->lock);
+
 	/* switch case accotding to socket's type*/
 	switch(socket->type)
 	{
@@ -90,11 +145,16 @@ int socket_close(void* socketcb_t)
 		case(SOCKET_UNBOUND):
 			break;
 
-		/* if the type is LISTENER then we set NULL the accoring position in PORT_MAP (it is available from now on)
-		 * and we singal the waiters*/
+		/* if the type is LISTENER then we set NULL the accoring position in PORT_MAP (it is available from now on),
+		 * we drop the pending requests and we singal the waiters*/
 		case(SOCKET_LISTENER):
 			PORT_MAP[socket->port] = NULL;
 
+			while(!is_rlist_empty(&socket->listener.queue)) {
+				connection_req* request = (connection_req*) rlist_pop_front(&socket->listener.queue)->obj;
+				kernel_signal(&request->connected_cv);
+			}
+
 			kernel_broadcast(&socket->listener.req_available);
 			break;
 		
@@ -107,39 +167,45 @@ int socket_close(void* socketcb_t)
 			pipe_reader_close(socket->peer.read);
 			socket->peer.read = NULL;
 			break;
-
-		default:
-			return -1;
 	}
 
-	/* if the refcount to this specific socket it 0 then we can free it*/
-	if(socket->refcount == 0){
+	/* if the refcount to this specific socket it 0 then we can free it, 
+	 * else the last socket_decref() frees it*/
+	socket->closed = 1;
+	int unused = (socket->refcount == 0);
+
+	Mutex_Unlock(&socket->lock);
+	Mutex_Unlock(&port_map_lock);
+
+	if(unused)
 		free(socket);
-	}	
 
 	return 0;
 }
 
 int sys_Listen(Fid_t sock)
 {
-	/* checking if the sock value is illegal (below 0 or above MAX_FILEID), get_fcb() also makes a similar test*/
-	if(sock < 0 || sock > MAX_FILEID - 1 || get_fcb(sock) == NULL)
+	/* getting the socket_cb from the streamobj of the matched fcb*/
+	socket_cb* socket = get_socket(sock);
+
+	if(socket == NULL)
 		return NOFILE;
 
-	/* getting the socket_cb from the streamobj of the matched fcb*/
-	socket_cb* socket = (socket_cb*) get_fcb(sock)->streamobj;
+	int ret = -1;
+	Mutex_Lock(&port_map_lock);
+	Mutex_Lock(&socket->lock);
 
-	/* if socket is NUll or its matched port in NOPORT then return -1*/
-	if(socket == NULL || socket->port == NOPORT)
-		return -1;
+	/* if its matched port in NOPORT then return -1*/
+	if(socket->port == NOPORT)
+		goto finish;
 
 	/* if the PORT_MAP at socket->port is not NULL then it is not available and we return -1*/
 	if(PORT_MAP[socket->port] != NULL)
-		return -1;
+		goto finish;
 
 	/* if the socket->type is not UNBOUND then return -1*/
 	if(socket->type != SOCKET_UNBOUND)
-		return -1;
+		goto finish;
 
 	/* we now set socket as LISTENER socket*/
 	PORT_MAP[socket->port] = socket;
@@ -148,67 +214,85 @@ int sys_Listen(Fid_t sock)
 	/* initializing the fields of the listener_socket struct*/
 	rlnode_init(&socket->listener.queue, NULL);
 	socket->listener.req_available = COND_INIT;
+	ret = 0;
 
-	return 0;
+finish:
+	Mutex_Unlock(&socket->lock);
+	Mutex_Unlock(&port_map_lock);
+	socket_decref(socket);
+	return ret;
 }
 
 
 Fid_t sys_Accept(Fid_t lsock)
 {
-	/* checking if the sock value is illegal (below 0 or above MAX_FILEID), get_fcb() also makes a similar test*/
-	if(lsock < 0 || lsock > MAX_FILEID - 1 || get_fcb(lsock) == NULL)
-		return NOFILE;
-
 	/* getting the socket_cb from the streamobj of the matched fcb*/
-	socket_cb* listener = (socket_cb*) get_fcb(lsock)->streamobj;
-
-	/* if the listener is NULL or its type is not type LISTENER return NOFILE*/
-	if(listener == NULL || listener->type!=SOCKET_LISTENER)
-		return NOFILE;
+	socket_cb* listener = get_socket(lsock);
 
-	/* increasing the refcount*/
-	listener->refcount++;
-
-	/* if listener's queue is empty (no one is waiting for connection) and 
-	 * the PORT_MAP at listener->sock position is not NULL then wait*/
-	while(is_rlist_empty(&listener->listener.queue) && PORT_MAP[listener->port] != NULL)
-		kernel_wait(&listener->listener.req_available, SCHED_PIPE);
-
-	/* if while we waited the PORT_MAP at listener->sock position became NULL, then we decrease the refcount and return NOFILE*/
-	if(PORT_MAP[listener->port] == NULL){
-		listener->refcount--;
+	if(listener == NULL)
 		return NOFILE;
-	}
 
-	/* if listener is NULL or its type is not LISTNER or PORT_MAP at listener->sock position 
-	 * was given to another socket, then we decrease the refcount and return NOFILE*/
-	if(listener == NULL || listener->type != SOCKET_LISTENER || PORT_MAP[listener->port] != listener){
-		listener->refcount--;
-		return NOFILE;
-	}
-
-	/* getting a request from listener's waiting to connect list*/
-	connection_req* request = (connection_req*) rlist_pop_front(&listener->listener.queue)->obj;
-
-	Fid_t peer = sys_Socket(listener->port);
-
-	/* if peer is matched to NOFILE or get_fcb detect an illegal fid then we decrease refcount and return NOFILE*/
-	if(peer == NOFILE || get_fcb(peer) == NULL){
-		listener->refcount--;
-		return NOFILE;
+	Fid_t peer = NOFILE;
+	socket_cb* peer_socket = NULL;
+	connection_req* request = NULL;
+	socket_cb* req_socket = NULL;
+	int admitted = 0;
+	int peer_closed;
+
+	Mutex_Lock(&port_map_lock);
+
+	/* if the listener type is not type LISTENER return NOFILE*/
+	if(listener->type!=SOCKET_LISTENER)
+		goto finish;
+
+	while(1) {
+		/* if listener's queue is empty (no one is waiting for connection) and 
+		 * the PORT_MAP at listener->sock position is still the listener then wait*/
+		while(is_rlist_empty(&listener->listener.queue) && PORT_MAP[listener->port] == listener)
+			kernel_wait(&port_map_lock, &listener->listener.req_available, SCHED_PIPE);
+
+		/* if while we waited the listener was closed, then we return NOFILE*/
+		if(PORT_MAP[listener->port] != listener)
+			goto finish;
+
+		if(peer != NOFILE) {
+			/* closing the peer socket needs port_map_lock, so it is still open
+			 * unless it was closed before we locked again */
+			if(peer_socket->closed)
+				goto finish;
+
+			/* getting a request from listener's waiting to connect list*/
+			request = (connection_req*) rlist_pop_front(&listener->listener.queue)->obj;
+
+			/* we get the socket_cb from the request's struct*/
+			req_socket = request->peer;
+
+			/* the requester's fid may have been closed while it waits in Connect,
+			 * then we drop the request and take the next one */
+			Mutex_Lock(&req_socket->lock);
+			if(!req_socket->closed)
+				break;
+			Mutex_Unlock(&req_socket->lock);
+			kernel_signal(&request->connected_cv);
+			continue;
+		}
+
+		/* making the peer socket takes the lock of the process, which comes 
+		 * before port_map_lock, so we check the queue again afterwards */
+		Mutex_Unlock(&port_map_lock);
+		peer = sys_Socket(listener->port);
+		if(peer != NOFILE)
+			peer_socket = get_socket(peer);
+		Mutex_Lock(&port_map_lock);
+
+		/* if peer is matched to NOFILE or it was closed meanwhile then we return NOFILE*/
+		if(peer_socket == NULL)
+			goto finish;
 	}
 
 	/* mark the request as admitted*/
 	request->admitted = 1;
-
-	/* we get the socket_cbs from the streamobj of the fcb to fid_t peer, 
-	 * and from the request's struct*/
-	socket_cb* peer_socket = (socket_cb*) get_fcb(peer)->streamobj;
-	socket_cb* req_socket = request->peer;
-
-	/* we mark both of them as PEER sockets since a connection was established*/
-	peer_socket->type = SOCKET_PEER;
-	req_socket->type = SOCKET_PEER;
+	admitted = 1;
 
 	/* initializing two pipe_cbs*/
 	pipe_cb* pipe1 = init_Pipe();
@@ -216,22 +300,43 @@ Fid_t sys_Accept(Fid_t lsock)
 
 	/* making the needed connections between the sockets' fcbs and 
 	 * the pipes' readers and writers, furthermore we connect the 
-	 * sockets' peer read and write to the according pipes*/
+	 * sockets' peer read and write to the according pipes.
+	 * we mark both of them as PEER sockets since a connection was established*/
 	pipe1->writer = req_socket->fcb;
 	pipe2->reader = req_socket->fcb;
-	pipe2->writer = peer_socket->fcb;
-	pipe1->reader = peer_socket->fcb;
-
 	req_socket->peer.read = pipe2;
 	req_socket->peer.write = pipe1;
+	req_socket->type = SOCKET_PEER;
+	Mutex_Unlock(&req_socket->lock);
+
+	Mutex_Lock(&peer_socket->lock);
+	pipe2->writer = peer_socket->fcb;
+	pipe1->reader = peer_socket->fcb;
 	peer_socket->peer.read = pipe1;
 	peer_socket->peer.write = pipe2;
+	peer_socket->type = SOCKET_PEER;
+	Mutex_Unlock(&peer_socket->lock);
 
-	/* signal all the waiters*/
+	/* signal the waiter, we do not know if we block next, so we do not hand off*/
 	kernel_signal(&request->connected_cv);
 
-	/* decrease the refcount since the connection was fulfilled*/
-	listener->refcount--;
+finish:
+	/* if another thread closed the peer socket, its fid may already be reused */
+	peer_closed = (peer_socket == NULL || peer_socket->closed);
+	Mutex_Unlock(&port_map_lock);
+
+	if(peer_socket != NULL)
+		socket_decref(peer_socket);
+
+	/* the peer socket we made is not needed after all */
+	if(peer != NOFILE && !admitted) {
+		if(!peer_closed)
+			sys_Close(peer);
+		peer = NOFILE;
+	}
+
+	/* drop our reference to the listener*/
+	socket_decref(listener);
 
 	return peer;
 }
@@ -239,35 +344,31 @@ Fid_t sys_Accept(Fid_t lsock)
 
 int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 {
-	/* checking if the sock value is illegal (below 0 or above MAX_FILEID), get_fcb() also makes a similar test*/
-	if(sock < 0 || sock > MAX_FILEID - 1 || get_fcb(sock) == NULL)
+	/* getting the socket_cb from the streamobj of the fcb of sock*/
+	socket_cb* self_socket = get_socket(sock);
+
+	if(self_socket == NULL)
 		return NOFILE;
 
 	/* checking if given port is illegal*/
-	if(port <= NOPORT || port > MAX_PORT - 1)
+	if(port <= NOPORT || port > MAX_PORT - 1) {
+		socket_decref(self_socket);
 		return -1;
+	}
 
-	/* if the PORT_MAP at port position is NULL or if its type is not type LISTENER return -1*/
-	if(PORT_MAP[port] == NULL || PORT_MAP[port]->type != SOCKET_LISTENER)
-		return -1;
+	int ret = -1;
+	Mutex_Lock(&port_map_lock);
 
-	/* getting fcb from fid_t sock and checking if it is NULL*/
-	FCB* self_fcb = get_fcb(sock);
-	if(self_fcb == NULL)
-		return -1;
+	/* getting the listener socket from the PORT_MAP at the port position*/
+	socket_cb* listener_socket = PORT_MAP[port];
 
-	/* getting the socket_cb from fcb's streamobj*/
-	socket_cb* self_socket = self_fcb->streamobj;
+	/* if the PORT_MAP at port position is NULL or if its type is not type LISTENER return -1*/
+	if(listener_socket == NULL || listener_socket->type != SOCKET_LISTENER)
+		goto finish;
 
 	/* if it is not UNBOUND (which means it already has another role), return -1*/
 	if(self_socket->type != SOCKET_UNBOUND)
-		return -1;
-
-	/* getting the listener socket from the PORT_MAP at the port position*/
-	socket_cb* listener_socket = PORT_MAP[port];
-
-	/* increasing self_socket's refcount*/
-	self_socket->refcount++;
+		goto finish;
 
     /* allocating the needed space to create a new connection_req*/
 	connection_req* request = (connection_req*) xmalloc(sizeof(connection_req));
@@ -289,35 +390,40 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	/* signal that a new request is available*/
 	kernel_signal(&listener_socket->listener.req_available);
 
-	int timeOut;
-	/* while the request is not admitted to timed wait for timeout and cause SCHED_PIPE*/
-	while(request->admitted == 0){
-		timeOut = kernel_timedwait(&request->connected_cv, SCHED_PIPE, timeout);
+	/* while the request is not admitted, or dropped by the listener, 
+	 * do timed wait for timeout and cause SCHED_PIPE*/
+	while(request->admitted == 0 && !is_rlist_empty(&request->queue_node)){
 		/* if it is 0 it means it was not signalled*/
-		if(timeOut == 0)
+		if(kernel_timedwait(&port_map_lock, &request->connected_cv, SCHED_PIPE, timeout) == 0)
 			break;
 	}
 
-	/* decrease refcount*/
-	self_socket->refcount--;
-	
+	/* on timeout, withdraw the request from the listener's list*/
+	rlist_remove(&request->queue_node);
+
 	/* return 0 if the request was admitted and -1 if it was not*/
-	return (request->admitted == 1) ? 0 : -1;
+	ret = (request->admitted == 1) ? 0 : -1;
+	free(request);
+
+finish:
+	Mutex_Unlock(&port_map_lock);
+
+	/* drop our reference to the socket*/
+	socket_decref(self_socket);
+	return ret;
 }
 
 
 int sys_ShutDown(Fid_t sock, shutdown_mode how)
 {	
-	/* checking if the sock value is illegal (below 0 or above MAX_FILEID), get_fcb() also makes a similar test*/
-	if(sock < 0 || sock > MAX_FILEID-1 || get_fcb(sock)==NULL){
-		return -1;
-	}
-
-	socket_cb* socket = (socket_cb*) get_fcb(sock)->streamobj;
+	socket_cb* socket = get_socket(sock);
 
 	if(socket == NULL)
 		return -1;
 
+	int ret = 0;
+	Mutex_Lock(&socket->lock);
+
 	/* switch case according to the shutdown_mode*/
 	switch(how){
 		/* closing the peer's read end*/
@@ -341,9 +447,10 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 			break;
 
 		default:
-			return -1;
+			ret = -1;
 	}
 
-	return 0;
+	Mutex_Unlock(&socket->lock);
+	socket_decref(socket);
+	return ret;
 }
-
@@ -11,6 +11,9 @@
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
 
+/* Protects the free list and the reference counts of FCBs */
+static Mutex fcb_table_lock = MUTEX_INIT;
+
 
 void initialize_files()
 {
@@ -24,6 +27,7 @@ void initialize_files()
 }
 
 
+/* Must be called with fcb_table_lock held */
 FCB* acquire_FCB()
 {
   if(! is_rlist_empty(& FCB_freelist)) {
@@ -35,6 +39,7 @@ FCB* acquire_FCB()
     return NULL;
 }
 
+/* Must be called with fcb_table_lock held */
 void release_FCB(FCB* fcb)
 {
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
@@ -44,16 +49,24 @@ void release_FCB(FCB* fcb)
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
+  Mutex_Lock(&fcb_table_lock);
   fcb->refcount++;
+  Mutex_Unlock(&fcb_table_lock);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  Mutex_Lock(&fcb_table_lock);
+  int last = (--fcb->refcount == 0);
+  Mutex_Unlock(&fcb_table_lock);
+
+  if(last) {
+    /* Close may block, so it is called without the lock */
     int retval = fcb->streamfunc->Close(fcb->streamobj);
+    Mutex_Lock(&fcb_table_lock);
     release_FCB(fcb);
+    Mutex_Unlock(&fcb_table_lock);
     return retval;
   }
   else
@@ -67,6 +80,10 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     PCB* cur = CURPROC;
     size_t f=0;
     uint i;
+    int ret = 0;
+
+    Mutex_Lock(&cur->lock);
+    Mutex_Lock(&fcb_table_lock);
 
     /* Find distinct fids */
     for(i=0; i<num; i++) {
@@ -75,7 +92,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto finish;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,14 +103,18 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	goto finish;
     }
     /* Found all */
     for(i=0;i<num;i++) {
 	cur->FIDT[fid[i]]=fcb[i];
-	FCB_incref(fcb[i]);
+	fcb[i]->refcount++;
     }
-    return 1;
+    ret = 1;
+finish:
+    Mutex_Unlock(&fcb_table_lock);
+    Mutex_Unlock(&cur->lock);
+    return ret;
 }
 
 
@@ -101,11 +122,15 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(&cur->lock);
+    Mutex_Lock(&fcb_table_lock);
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
 	cur->FIDT[fid[i]] = NULL;
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(&fcb_table_lock);
+    Mutex_Unlock(&cur->lock);
 }
 
 
@@ -128,6 +153,20 @@ FCB* get_fcb(Fid_t fid)
 }
 
 
+FCB* get_fcb_ref(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+  FCB* fcb = cur->FIDT[fid];
+  if(fcb) 
+    FCB_incref(fcb);
+  Mutex_Unlock(&cur->lock);
+  return fcb;
+}
+
+
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
@@ -135,16 +174,13 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
   void* sobj;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream, making sure that the stream will 
+     not be closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
     sobj = fcb->streamobj;
     devread = fcb->streamfunc->Read;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
   
     if(devread)
       retcode = devread(sobj, buf, size);
@@ -152,9 +188,6 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
 
   return retcode;
 }
@@ -167,19 +200,15 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
   void* sobj = NULL;
 
   
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the fields from the stream, making sure that the stream will 
+     not be closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
 
     sobj = fcb->streamobj;
     devwrite = fcb->streamfunc->Write;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-
     if(devwrite)
       retcode = devwrite(sobj, buf, size);
 
@@ -197,12 +226,17 @@ int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
 
-  FCB* fcb = get_fcb(fd);
+  if(retcode < 0)
+    return retcode;
 
-  if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+  FCB* fcb = cur->FIDT[fd];
+  cur->FIDT[fd] = NULL;
+  Mutex_Unlock(&cur->lock);
+
+  if(fcb)
     retcode = FCB_decref(fcb);    
-  }
 
   return retcode;
 }
@@ -221,18 +255,23 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+  FCB* old = cur->FIDT[oldfd];
+  FCB* new = cur->FIDT[newfd];
 
   if(old==NULL) {
     retcode = -1;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    cur->FIDT[newfd] = old;
   }
+  Mutex_Unlock(&cur->lock);
+
+  /* The replaced stream is closed without the lock */
+  if(old!=NULL && old!=new && new!=NULL)
+    FCB_decref(new);
 
   return retcode;
 }
@@ -119,12 +119,24 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
+	Note that another thread of the process may close the fid at
+	any time; use @ref get_fcb_ref to keep using the FCB.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
  */
 FCB* get_fcb(Fid_t fid);
 
+/** @brief Translate an fid to an FCB, and take a reference to it.
+
+	This is like @ref get_fcb, but the stream will not be closed 
+	until the caller releases the reference with @ref FCB_decref.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL.
+ */
+FCB* get_fcb_ref(Fid_t fid);
+
 /*******************************************
  *
  * Pipes 
@@ -140,6 +152,8 @@ FCB* get_fcb(Fid_t fid);
 typedef struct pipe_control_block
 {
 	FCB *reader, *writer;
+
+	Mutex lock;							/**< @brief Protects the buffer and the two ends */
 	
 	CondVar has_space;						/**< @brief condition variable for pipe has space*/
 	CondVar has_data;						/**< @brief condition variable for pipe has data*/
@@ -300,7 +314,9 @@ typedef struct peer_socket
  */
 typedef struct socket_control_block
 {
+	Mutex lock;							/**< @brief Protects the fields of the socket */
 	uint refcount; 						/**< @brief amount of sockets waiting this socket for something */
+	int closed;							/**< @brief set when the socket is closed, it is freed when @c refcount drops to 0 */
 
 	FCB* fcb; 							/**< @brief a file control block used for reading/writing */
 
@@ -9,12 +9,21 @@ SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
 SYSCALLV(Exit, (int exitval), (exitval))\
 SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
+SYSCALL(SetNice, int, (Pid_t pid, int nice), (pid, nice))\
+SYSCALL(GetNice, int, (Pid_t pid, int* nice), (pid, nice))\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(CreateThreadStack, Tid_t, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
+SYSCALL(SetThreadPriority, int, (Tid_t tid, int priority), (tid, priority))\
+SYSCALL(GetThreadPriority, int, (Tid_t tid), (tid))\
+SYSCALL(SetAffinity, int, (Tid_t tid, cpumask_t mask), (tid, mask))\
+SYSCALL(GetAffinity, int, (Tid_t tid, cpumask_t* mask), (tid, mask))\
+SYSCALL(SetThreadRT, int, (Tid_t tid, unsigned long runtime, unsigned long period, unsigned long deadline), (tid, runtime, period, deadline))\
+SYSCALL(GetThreadDeadlineMisses, int, (Tid_t tid), (tid))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
@@ -4,6 +4,7 @@
 #include "kernel_cc.h"
 #include "kernel_streams.h"
 
+/* Must be called with the lock of the current process held */
 PTCB* acquire_PTCB(TCB* tcb)
 {
   /* allocating the needed space to create a new process thread control block*/
@@ -43,15 +44,14 @@ void start_thread()
   sys_ThreadExit(exitval);
 }
 
-/** 
-  @brief Create a new thread in the current process.
-  */
-Tid_t sys_CreateThread(Task task, int argl, void* args)
+/* Create a new thread in the current process, with the given stack size */
+static Tid_t create_thread(Task task, int argl, void* args, size_t stack_size)
 {
-  TCB* curr_tcb = spawn_thread(CURPROC, start_thread);
+  TCB* curr_tcb = spawn_thread_stack(CURPROC, start_thread, stack_size);
 
   /* we initialize the fields of the new ptcb, define its task & arguments
    * and connecting it with the thread's ptcb */
+  Mutex_Lock(&CURPROC->lock);
   PTCB* new_ptcb = acquire_PTCB(curr_tcb);
   new_ptcb->task = task;
   new_ptcb->argl = argl;
@@ -60,6 +60,7 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
 
   /* increasing current process thread counter by one */
   CURPROC->thread_count++;
+  Mutex_Unlock(&CURPROC->lock);
 
   /* the new thread is now ready to run so it has to wakeup */
   wakeup(curr_tcb);
@@ -67,6 +68,27 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
   return (Tid_t) new_ptcb;
 }
 
+/** 
+  @brief Create a new thread in the current process.
+  */
+Tid_t sys_CreateThread(Task task, int argl, void* args)
+{
+  return create_thread(task, argl, args, THREAD_STACK_SIZE);
+}
+
+/** 
+  @brief Create a new thread in the current process, with the given stack size.
+  */
+Tid_t sys_CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size)
+{
+  if(stack_size == 0)
+    stack_size = THREAD_STACK_SIZE;
+  else if(stack_size < THREAD_STACK_MIN || stack_size > THREAD_STACK_MAX)
+    return NOTHREAD;
+
+  return create_thread(task, argl, args, stack_size);
+}
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -83,15 +105,19 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   /* if tid is illegal or corresponds to itself return -1*/
   if(tid <= 0 || tid == sys_ThreadSelf())
     return -1;
+
+  PCB* curproc = CURPROC;
+  int ret = -1;
+  Mutex_Lock(&curproc->lock);
   
   //get node with ptcb to join else null
   /* searching for the ptcb of the thread we want to join, if it
    * does not exist it returns NULL*/
-  rlnode* temp = rlist_find(&CURPROC->ptcb_list, (PTCB*)tid, NULL);
+  rlnode* temp = rlist_find(&curproc->ptcb_list, (PTCB*)tid, NULL);
 
   /* tid does not correspond to a thread of the current process*/
   if(temp == NULL)
-    return -1;
+    goto finish;
 
   /* passing ptcb out of the node */
   PTCB* threadref = temp->ptcb;
@@ -99,21 +125,21 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   /* if the thread we want to join is detached then join is
    * not permitted and returns -1*/
   if(threadref->detached == 1)
-    return -1;
+    goto finish;
 
   /* update reference counter */
   threadref->refcount++;
 
   /* while the thread we joined has not finished then sleep*/
   while(threadref->exited == 0 && threadref->detached == 0)
-    kernel_wait(&threadref->exit_cv, SCHED_USER);
+    kernel_wait(&curproc->lock, &threadref->exit_cv, SCHED_USER);
   
   /* update reference counter */
   threadref->refcount--;
 
   /* if the thread we joined becomes detached */
   if(threadref->detached == 1)
-    return -1;
+    goto finish;
 
   /* at exit */
   if(exitval!=NULL)
@@ -127,7 +153,10 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
     free(threadref);
   }
 
-  return 0;
+  ret = 0;
+finish:
+  Mutex_Unlock(&curproc->lock);
+  return ret;
 }
 
 /**
@@ -136,24 +165,133 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
 int sys_ThreadDetach(Tid_t tid)
 { 
   PTCB* ptcb = (PTCB*) tid;
+  int ret = -1;
+  Mutex_Lock(&CURPROC->lock);
 
   /* checking to see if the given ptcb exists in the current process
    * at failure it returns NULL and then we return -1*/
-  if(rlist_find(&CURPROC->ptcb_list,ptcb,NULL) == NULL)
+  if(rlist_find(&CURPROC->ptcb_list,ptcb,NULL) != NULL && !ptcb->exited) {
+    /* marking the ptcb as detached */
+    ptcb->detached = 1;
+
+    /* singals all the waiters */
+    kernel_broadcast(&ptcb->exit_cv);
+    ret = 0;
+  }
+
+  Mutex_Unlock(&CURPROC->lock);
+  return ret;
+}
+
+/* 
+  Return the ptcb of a live thread of the current process, or NULL.
+  The current process is locked, if the thread is found; the thread 
+  cannot exit until the caller calls release_live_thread().
+ */
+static PTCB* find_live_thread(Tid_t tid)
+{
+  Mutex_Lock(&CURPROC->lock);
+  rlnode* node = rlist_find(&CURPROC->ptcb_list, (PTCB*)tid, NULL);
+  if(node == NULL || node->ptcb->exited) {
+    Mutex_Unlock(&CURPROC->lock);
+    return NULL;
+  }
+  return node->ptcb;
+}
+
+static void release_live_thread()
+{
+  Mutex_Unlock(&CURPROC->lock);
+}
+
+/**
+  @brief Set the priority of a thread.
+  */
+int sys_SetThreadPriority(Tid_t tid, int priority)
+{
+  if(priority < THREAD_PRIORITY_MIN || priority > THREAD_PRIORITY_MAX)
     return -1;
-  
-  if(ptcb->exited)
+  PTCB* ptcb = find_live_thread(tid);
+  if(ptcb == NULL)
     return -1;
 
-  /* marking the ptcb as detached */
-  ptcb->detached = 1;
+  sched_set_priority(ptcb->tcb, priority);
+  release_live_thread();
+  return 0;
+}
 
-  /* singals all the waiters */
-  kernel_broadcast(&ptcb->exit_cv);
-  
+/**
+  @brief Return the priority of a thread.
+  */
+int sys_GetThreadPriority(Tid_t tid)
+{
+  PTCB* ptcb = find_live_thread(tid);
+  if(ptcb == NULL)
+    return -1;
+
+  int priority = ptcb->tcb->base_priority;
+  release_live_thread();
+  return priority;
+}
+
+/**
+  @brief Set the affinity of a thread.
+  */
+int sys_SetAffinity(Tid_t tid, cpumask_t mask)
+{
+  PTCB* ptcb = find_live_thread(tid);
+  if(ptcb == NULL)
+    return -1;
+
+  int ret = sched_set_affinity(ptcb->tcb, mask);
+  release_live_thread();
+  return ret;
+}
+
+/**
+  @brief Get the affinity of a thread.
+  */
+int sys_GetAffinity(Tid_t tid, cpumask_t* mask)
+{
+  if(mask == NULL)
+    return -1;
+  PTCB* ptcb = find_live_thread(tid);
+  if(ptcb == NULL)
+    return -1;
+
+  *mask = sched_get_affinity(ptcb->tcb);
+  release_live_thread();
   return 0;
 }
 
+/**
+  @brief Set the real-time parameters of a thread.
+  */
+int sys_SetThreadRT(Tid_t tid, unsigned long runtime, unsigned long period, unsigned long deadline)
+{
+  PTCB* ptcb = find_live_thread(tid);
+  if(ptcb == NULL)
+    return -1;
+
+  int ret = sched_set_rt(ptcb->tcb, runtime, period, deadline);
+  release_live_thread();
+  return ret;
+}
+
+/**
+  @brief Return the number of deadlines a thread has missed.
+  */
+int sys_GetThreadDeadlineMisses(Tid_t tid)
+{
+  PTCB* ptcb = find_live_thread(tid);
+  if(ptcb == NULL)
+    return -1;
+
+  int misses = ptcb->tcb->rt_misses;
+  release_live_thread();
+  return misses;
+}
+
 /**
   @brief Terminate the current thread.
   */
@@ -161,6 +299,9 @@ void sys_ThreadExit(int exitval)
 {
   TCB* cur_tcb = cur_thread();
   PTCB* cur_ptcb =  cur_tcb->ptcb;
+  PCB* curproc = CURPROC;
+  Mutex_Lock(&curproc->lock);
+
   /* defining ptcb's exit value */
   cur_ptcb->exitval = exitval;
 
@@ -168,69 +309,76 @@ void sys_ThreadExit(int exitval)
   cur_ptcb->exited = 1;
 
   /* decreasing current process' threads by 1 */
-  PCB* curproc = CURPROC;
   curproc->thread_count--;
 
   /* wake up all the threads waiting on this one */ 
   kernel_broadcast(&cur_ptcb->exit_cv);
 
-  /* if this is the last thread of the current process*/
-  if(curproc->thread_count==0){
-    if(get_pid(curproc)!=1){
-      /* Reparent any children of the exiting process to the 
-      initial task */
-      PCB* initpcb = get_pcb(1);
-      while(!is_rlist_empty(& curproc->children_list)) {
-        rlnode* child = rlist_pop_front(& curproc->children_list);
-        child->pcb->parent = initpcb;
-        rlist_push_front(& initpcb->children_list, child);
-      }
-
-      /* Add exited children to the initial task's exited list 
-         and signal the initial task */
-      if(!is_rlist_empty(& curproc->exited_list)) {
-        rlist_append(& initpcb->exited_list, &curproc->exited_list);
-        kernel_broadcast(& initpcb->child_exit);
-      }
-
-      /* Put me into my parent's exited list */
-      rlist_push_front(& curproc->parent->exited_list, &curproc->exited_node);
-      kernel_broadcast(& curproc->parent->child_exit);
-    }
-    
-    assert(is_rlist_empty(& curproc->children_list));
-    assert(is_rlist_empty(& curproc->exited_list));
-
-
-    /* 
-      Do all the other cleanup we want here, close files etc. 
-    */
-    
-    /* Release the args data */
-    if(curproc->args) {
-      free(curproc->args);
-      curproc->args = NULL;
+  /* 
+    If this is not the last thread of the current process, bye-bye cruel 
+    world. A joiner may free our ptcb as soon as the lock is released.
+   */
+  if(curproc->thread_count > 0)
+    sleep_releasing(EXITED, &curproc->lock, SCHED_USER, NO_TIMEOUT);
+
+  /* This is the last thread: nobody else uses the file table or the ptcbs */
+  Mutex_Unlock(&curproc->lock);
+
+  /* 
+    Do all the other cleanup we want here, close files etc. 
+  */
+
+  /* Clean up FIDT */
+  for(int i=0;i<MAX_FILEID;i++) {
+    if(curproc->FIDT[i] != NULL) {
+      FCB_decref(curproc->FIDT[i]);
+      curproc->FIDT[i] = NULL;
     }
+  }
+
+  /* checking if list has emptied and freeing any remaining ptcbs */
+  while(!is_rlist_empty(&curproc->ptcb_list))
+   free(rlist_pop_front(&curproc->ptcb_list)->ptcb); 
+
+  Mutex_Lock(&proc_table_lock);
 
-    /* Clean up FIDT */
-    for(int i=0;i<MAX_FILEID;i++) {
-      if(curproc->FIDT[i] != NULL) {
-        FCB_decref(curproc->FIDT[i]);
-        curproc->FIDT[i] = NULL;
-      }
+  if(get_pid(curproc)!=1){
+    /* Reparent any children of the exiting process to the 
+    initial task */
+    PCB* initpcb = get_pcb(1);
+    while(!is_rlist_empty(& curproc->children_list)) {
+      rlnode* child = rlist_pop_front(& curproc->children_list);
+      child->pcb->parent = initpcb;
+      rlist_push_front(& initpcb->children_list, child);
     }
 
-    /* checking if list has emptied and freeing any remaining ptcbs */
-    while(!is_rlist_empty(&curproc->ptcb_list))
-     free(rlist_pop_front(&curproc->ptcb_list)->ptcb); 
+    /* Add exited children to the initial task's exited list 
+       and signal the initial task */
+    if(!is_rlist_empty(& curproc->exited_list)) {
+      rlist_append(& initpcb->exited_list, &curproc->exited_list);
+      kernel_broadcast(& initpcb->child_exit);
+    }
 
-    /* Disconnect my main_thread */
-    curproc->main_thread = NULL;
+    /* Put me into my parent's exited list */
+    rlist_push_front(& curproc->parent->exited_list, &curproc->exited_node);
+    kernel_broadcast(& curproc->parent->child_exit);
+  }
+  
+  assert(is_rlist_empty(& curproc->children_list));
+  assert(is_rlist_empty(& curproc->exited_list));
 
-    /* Now, mark the process as exited. */
-    curproc->pstate = ZOMBIE;
+  /* Release the args data */
+  if(curproc->args) {
+    free(curproc->args);
+    curproc->args = NULL;
   }
 
+  /* Disconnect my main_thread */
+  curproc->main_thread = NULL;
+
+  /* Now, mark the process as exited. */
+  curproc->pstate = ZOMBIE;
+
   /* Bye-bye cruel world */
-  kernel_sleep(EXITED, SCHED_USER);
+  sleep_releasing(EXITED, &proc_table_lock, SCHED_USER, NO_TIMEOUT);
 }
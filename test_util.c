@@ -268,6 +268,124 @@ TEST_SUITE(rlist_tests,
 
 
 
+static int num_less(avl_node* a, avl_node* b) { return a->num < b->num; }
+
+/* Check the tree invariants, return the number of nodes */
+static int avl_check(avl_node* n, avl_node* parent)
+{
+	if(n==NULL) return 0;
+	ASSERT(n->parent == parent);
+	int hl = avl_height(n->left), hr = avl_height(n->right);
+	ASSERT(n->height == 1 + (hl>hr ? hl : hr));
+	ASSERT(hl-hr <= 1 && hr-hl <= 1);
+	if(n->left) ASSERT(! num_less(n, n->left));
+	if(n->right) ASSERT(! num_less(n->right, n));
+	return 1 + avl_check(n->left, n) + avl_check(n->right, n);
+}
+
+/* Check that an in-order walk returns a sorted sequence of N nodes */
+static void avl_check_order(avl_tree* T, int N)
+{
+	ASSERT(avl_check(T->root, NULL) == N);
+	int count = 0;
+	for(avl_node* n = avl_first(T); n != NULL; n = avl_next(n)) {
+		avl_node* m = avl_next(n);
+		if(m) ASSERT(! num_less(m, n));
+		count++;
+	}
+	ASSERT(count == N);
+}
+
+
+BARE_TEST(test_avl_init,
+	"Test tree initialization."
+	)
+{
+	avl_tree T;
+	avl_init(&T, num_less);
+	ASSERT(is_avl_empty(&T));
+	ASSERT(avl_first(&T)==NULL);
+
+	avl_node n;
+	avl_node_init(&n, NULL)->num = 3;
+	avl_insert(&T, &n);
+	ASSERT(! is_avl_empty(&T));
+	ASSERT(avl_first(&T)==&n);
+	ASSERT(avl_next(&n)==NULL);
+
+	avl_remove(&T, &n);
+	ASSERT(is_avl_empty(&T));
+	ASSERT(avl_first(&T)==NULL);
+}
+
+
+BARE_TEST(test_avl_insert_remove,
+	"Test that the tree stays ordered and balanced under insertions and removals."
+	)
+{
+	enum { N = 1000 };
+	avl_node node[N];
+	avl_tree T;
+	avl_init(&T, num_less);
+
+	srand(42);
+	for(int i=0; i<N; i++) {
+		avl_node_init(&node[i], NULL)->num = rand() % 100;
+		avl_insert(&T, &node[i]);
+	}
+	avl_check_order(&T, N);
+
+	/* Remove every third node */
+	int n = N;
+	for(int i=0; i<N; i+=3) {
+		avl_remove(&T, &node[i]);
+		n--;
+	}
+	avl_check_order(&T, n);
+
+	/* Remove the rest, smallest first */
+	while(! is_avl_empty(&T)) {
+		avl_node* first = avl_first(&T);
+		for(avl_node* m = first; m != NULL; m = avl_next(m))
+			ASSERT(! num_less(m, first));
+		avl_remove(&T, first);
+		n--;
+	}
+	ASSERT(n == 0);
+}
+
+
+BARE_TEST(test_avl_fifo,
+	"Test that equal nodes are kept in insertion order."
+	)
+{
+	avl_node node[10];
+	avl_tree T;
+	avl_init(&T, num_less);
+
+	for(int i=0; i<10; i++) {
+		avl_node_init(&node[i], NULL)->num = 7;
+		avl_insert(&T, &node[i]);
+	}
+
+	int i = 0;
+	for(avl_node* n = avl_first(&T); n != NULL; n = avl_next(n))
+		ASSERT(n == &node[i++]);
+	ASSERT(i == 10);
+}
+
+
+TEST_SUITE(avl_tests,
+	"Tests for the AVL tree")
+{
+	&test_avl_init,
+	&test_avl_insert_remove,
+	&test_avl_fifo,
+	NULL
+};
+
+
+
 void test_argv(size_t argc, const char* argv[])
 {
 	int l = argvlen(argc, argv);
@@ -321,6 +439,7 @@ TEST_SUITE(all_tests,
 	"All tests")
 {
 	&rlist_tests,
+	&avl_tests,
 	&test_pack_unpack,
 	NULL
 };
@@ -72,11 +72,14 @@ typedef uintptr_t Tid_t;
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    A locked mutex records the thread that owns it, so that this thread can
+    inherit the priority of the threads waiting for the mutex.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef uintptr_t Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -110,6 +113,88 @@ void Mutex_Lock(Mutex*);
 void Mutex_Unlock(Mutex*);
 
 
+/** @brief A sleeping mutex.
+
+  A @c SleepMutex is like a @c Mutex, but a thread that finds it locked 
+  sleeps until it is unlocked, instead of spinning and yielding. Use it
+  for locks that may be held for long, or that many threads contend for.
+  Locking and unlocking a @c SleepMutex that is not contended does not 
+  enter the scheduler.
+
+  A @c SleepMutex cannot be used with condition variables, or in the 
+  non-preemptive domain of the kernel.
+
+  @see SleepMutex_Lock
+  @see SleepMutex_Unlock
+  @see SLEEPMUTEX_INIT
+ */
+typedef unsigned int SleepMutex;
+
+/** @brief This macro is used to initialize sleeping mutexes. */
+#define SLEEPMUTEX_INIT 0
+
+/** @brief Lock a sleeping mutex, sleeping as long as it is locked. 
+  @see SleepMutex
+ */
+void SleepMutex_Lock(SleepMutex*);
+
+/** @brief Lock a sleeping mutex, if it is unlocked. 
+  @returns 1 if the mutex was locked, 0 otherwise
+  @see SleepMutex
+ */
+int SleepMutex_TryLock(SleepMutex*);
+
+/** @brief Unlock a sleeping mutex that you locked, waking up a waiter. 
+  @see SleepMutex
+ */
+void SleepMutex_Unlock(SleepMutex*);
+
+
+/** @brief A reader-writer lock.
+
+  A reader-writer lock can be held by many readers at once, or by 
+  one writer. Writers are preferred: once a writer waits for the lock, 
+  new readers wait until it has taken and released the lock. A reader
+  takes an uncontended lock with a single atomic operation, and 
+  threads that have to wait for the lock sleep.
+
+  Like a @c SleepMutex, a reader-writer lock cannot be used in the 
+  non-preemptive domain of the kernel.
+
+  @see RW_ReadLock
+  @see RW_WriteLock
+  @see RWLOCK_INIT
+ */
+typedef struct {
+  unsigned int state;     /**< Readers, waiting writers and the writer flag */
+  unsigned int sleepers;  /**< Threads sleeping on the lock */
+  unsigned int epoch;     /**< Changes when the sleepers are woken up */
+} RWLock;
+
+/** @brief This macro is used to initialize reader-writer locks. */
+#define RWLOCK_INIT ((RWLock){ 0, 0, 0 })
+
+/** @brief Lock a reader-writer lock for reading. 
+  @see RWLock
+ */
+void RW_ReadLock(RWLock*);
+
+/** @brief Unlock a reader-writer lock that you locked for reading. 
+  @see RWLock
+ */
+void RW_ReadUnlock(RWLock*);
+
+/** @brief Lock a reader-writer lock for writing. 
+  @see RWLock
+ */
+void RW_WriteLock(RWLock*);
+
+/** @brief Unlock a reader-writer lock that you locked for writing. 
+  @see RWLock
+ */
+void RW_WriteUnlock(RWLock*);
+
+
 /** @brief Condition variables.
 
   A condition variable is used for longer synchronization. This implementation
@@ -291,6 +376,36 @@ Pid_t GetPid(void);
  */
 Pid_t GetPPid(void);
 
+/** @brief The smallest (highest-priority) nice value of a process. */
+#define NICE_MIN (-20)
+
+/** @brief The largest (lowest-priority) nice value of a process. */
+#define NICE_MAX 19
+
+/** @brief Set the nice value of a process.
+
+ The nice value biases the scheduling of all the threads of a process: 
+ a process with a positive nice value gets shorter time slices, and its 
+ threads are kept in the lower priority levels. A negative nice value
+ has the opposite effect. A new process inherits the nice value of its
+ parent.
+
+ @param pid the pid of the caller or of one of its children, or `NOPROC` for the caller
+ @param nice the nice value, between `NICE_MIN` and `NICE_MAX`
+ @returns 0 on success, or -1 if `pid` is not the caller or one of its 
+   children, or `nice` is out of range.
+ */
+int SetNice(Pid_t pid, int nice);
+
+/** @brief Get the nice value of a process.
+
+ @param pid the pid of the caller or of one of its children, or `NOPROC` for the caller
+ @param nice a location where the nice value is stored
+ @returns 0 on success, or -1 if `pid` is not the caller or one of its children.
+ @see SetNice
+ */
+int GetNice(Pid_t pid, int* nice);
+
 /*******************************************
  *
  * Threads
@@ -319,6 +434,28 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** @brief The minimum stack size of a thread, in bytes. */
+#define THREAD_STACK_MIN (16*1024)
+
+/** @brief The maximum stack size of a thread, in bytes. */
+#define THREAD_STACK_MAX (64*1024*1024)
+
+/** 
+  @brief Create a new thread with the given stack size.
+
+  This is the same as `CreateThread`, except that the stack of the 
+  new thread will be (at least) `stack_size` bytes. Memory for the
+  stack is only committed as the stack is used. A thread which 
+  overruns its stack faults.
+
+  @param task a function to execute
+  @param stack_size the stack size in bytes, or 0 for the default size
+  @returns the Tid of the new thread, or `NOTHREAD` if `stack_size` is 
+    not 0 and not between `THREAD_STACK_MIN` and `THREAD_STACK_MAX`.
+  @see CreateThread
+  */
+Tid_t CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -374,6 +511,218 @@ int ThreadDetach(Tid_t tid);
   */
 void ThreadExit(int exitval);
 
+/** @brief The lowest thread priority. */
+#define THREAD_PRIORITY_MIN 0
+
+/** @brief The highest thread priority. */
+#define THREAD_PRIORITY_MAX 4
+
+/** @brief The priority of a new thread. */
+#define THREAD_PRIORITY_DEFAULT 3
+
+/**
+  @brief Set the priority of a thread.
+
+  The priority is the level that the thread starts from in the 
+  multilevel feedback queue of the scheduler; the scheduler still
+  lowers it for threads that use up their time slices, and raises it 
+  for threads that wait for I/O. The nice value of the process biases
+  the priority further.
+
+  @param tid the thread, which must belong to the current process
+  @param priority the priority, between `THREAD_PRIORITY_MIN` and `THREAD_PRIORITY_MAX`
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - the priority is out of range.
+  @see SetNice
+  */
+int SetThreadPriority(Tid_t tid, int priority);
+
+/**
+  @brief Return the priority of a thread.
+
+  @param tid the thread, which must belong to the current process
+  @returns the priority last set by `SetThreadPriority` (or 
+    `THREAD_PRIORITY_DEFAULT`), or -1 if there is no thread with the 
+    given tid in this process, or it has exited.
+  */
+int GetThreadPriority(Tid_t tid);
+
+/** @brief The number of cores that a `cpumask_t` can hold. */
+#define CPUMASK_SIZE 128
+
+/** @brief The number of 64-bit words of a `cpumask_t`. */
+#define CPUMASK_WORDS (CPUMASK_SIZE / 64)
+
+/** 
+  @brief A set of cores: bit `c % 64` of word `c / 64` stands for core `c`. 
+
+  A mask should be manipulated with the `cpumask_...` functions below.
+  */
+typedef struct { uint64_t word[CPUMASK_WORDS]; } cpumask_t;
+
+/** @brief The empty set of cores. */
+static inline cpumask_t cpumask_none()
+{
+  cpumask_t mask;
+  for(unsigned int w=0; w < CPUMASK_WORDS; w++) mask.word[w] = 0;
+  return mask;
+}
+
+/** @brief The set of all cores. */
+static inline cpumask_t cpumask_all()
+{
+  cpumask_t mask;
+  for(unsigned int w=0; w < CPUMASK_WORDS; w++) mask.word[w] = ~(uint64_t)0;
+  return mask;
+}
+
+/** @brief The set of the cores `0` to `n-1`. */
+static inline cpumask_t cpumask_first_n(unsigned int n)
+{
+  cpumask_t mask = cpumask_none();
+  for(unsigned int w=0; w < CPUMASK_WORDS && 64*w < n; w++)
+    mask.word[w] = (n - 64*w >= 64) ? ~(uint64_t)0 : (((uint64_t)1 << (n - 64*w)) - 1);
+  return mask;
+}
+
+/** @brief Add core `c` to a mask. */
+static inline void cpumask_set(cpumask_t* mask, unsigned int c)
+{
+  mask->word[c / 64] |= (uint64_t)1 << (c % 64);
+}
+
+/** @brief Remove core `c` from a mask. */
+static inline void cpumask_clear(cpumask_t* mask, unsigned int c)
+{
+  mask->word[c / 64] &= ~((uint64_t)1 << (c % 64));
+}
+
+/** @brief Return non-zero if core `c` is in a mask. */
+static inline int cpumask_isset(const cpumask_t* mask, unsigned int c)
+{
+  return (mask->word[c / 64] >> (c % 64)) & 1;
+}
+
+/** @brief The set of the single core `c`. */
+static inline cpumask_t cpumask_of(unsigned int c)
+{
+  cpumask_t mask = cpumask_none();
+  cpumask_set(&mask, c);
+  return mask;
+}
+
+/** @brief The intersection of two masks. */
+static inline cpumask_t cpumask_and(cpumask_t a, cpumask_t b)
+{
+  for(unsigned int w=0; w < CPUMASK_WORDS; w++) a.word[w] &= b.word[w];
+  return a;
+}
+
+/** @brief Return non-zero if two masks are equal. */
+static inline int cpumask_equal(cpumask_t a, cpumask_t b)
+{
+  for(unsigned int w=0; w < CPUMASK_WORDS; w++) 
+    if(a.word[w] != b.word[w]) return 0;
+  return 1;
+}
+
+/** @brief Return non-zero if a mask is empty. */
+static inline int cpumask_empty(cpumask_t mask)
+{
+  for(unsigned int w=0; w < CPUMASK_WORDS; w++) 
+    if(mask.word[w]) return 0;
+  return 1;
+}
+
+/** @brief Return the lowest core of a mask, or -1 if it is empty. */
+static inline int cpumask_first(cpumask_t mask)
+{
+  for(unsigned int w=0; w < CPUMASK_WORDS; w++)
+    if(mask.word[w]) return w*64 + __builtin_ctzll(mask.word[w]);
+  return -1;
+}
+
+/** @brief The set of all cores. */
+#define CPUMASK_ALL (cpumask_all())
+
+/**
+  @brief Set the affinity of a thread.
+
+  The thread will only run on the cores in `mask`; cores that do not 
+  exist are ignored. A thread which is not on one of these cores is 
+  moved. By default, a thread may run on all cores.
+
+  Regardless of its affinity, a thread is preferably resumed on the 
+  core it last ran on.
+
+  @param tid the thread, which must belong to the current process
+  @param mask the cores the thread may run on
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - `mask` contains no existing core.
+    - the thread is a real-time thread, and `mask` excludes the core 
+      it was admitted to.
+  */
+int SetAffinity(Tid_t tid, cpumask_t mask);
+
+/**
+  @brief Get the affinity of a thread.
+
+  @param tid the thread, which must belong to the current process
+  @param mask a location where the cores the thread may run on are stored
+  @returns 0 on success and -1 if there is no thread with the given tid
+    in this process, or it has exited.
+  @see SetAffinity
+  */
+int GetAffinity(Tid_t tid, cpumask_t* mask);
+
+/**
+  @brief Make a thread a real-time thread.
+
+  A real-time thread is given `runtime` microseconds of CPU time in 
+  every period of `period` microseconds, to be used by its deadline, 
+  `deadline` microseconds after the start of the period. A period 
+  starts when the thread becomes ready after the end of the previous 
+  one. 
+
+  Real-time threads are scheduled earliest-deadline-first, and they 
+  always run before (and preempt) the other threads. A thread which 
+  uses up its runtime waits until the end of its period.
+
+  The thread is admitted to a core of its affinity, where the total 
+  density (runtime over deadline) of the real-time threads does not
+  exceed a fixed fraction of the core; from then on, it only runs on 
+  that core. The call fails if there is no such core.
+
+  @param tid the thread, which must belong to the current process
+  @param runtime the runtime per period, or 0 to make the thread a normal thread again
+  @param period the period
+  @param deadline the deadline, or 0 for a deadline equal to the period
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no thread with the given tid in this process.
+    - the tid corresponds to an exited thread.
+    - `runtime` is less than 1000, or more than the deadline, or the 
+      deadline is more than the period.
+    - the thread cannot be admitted.
+  */
+int SetThreadRT(Tid_t tid, unsigned long runtime, unsigned long period, unsigned long deadline);
+
+/**
+  @brief Return the number of deadlines a thread has missed.
+
+  A real-time thread misses the deadline of a period, if it has not 
+  blocked by then.
+
+  @param tid the thread, which must belong to the current process
+  @returns the number of missed deadlines, or -1 if there is no thread 
+    with the given tid in this process, or it has exited.
+  @see SetThreadRT
+  */
+int GetThreadDeadlineMisses(Tid_t tid);
+
 
 
 /*******************************************
@@ -780,6 +1129,25 @@ Fid_t OpenInfo();
    */
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
+/** @brief Scheduling policies. 
+
+  @see boot_with_policy
+ */
+typedef enum {
+	SCHED_POLICY_MLFQ,	/**< @brief Multi-level feedback queue (the default) */
+	SCHED_POLICY_CFS,	/**< @brief Fair scheduling by virtual run time */
+	SCHED_POLICY_RR		/**< @brief Plain round-robin */
+} sched_policy;
+
+/** @brief Boot tinyos3 with the given scheduling policy. 
+
+   This is the same as @c boot(), but the kernel scheduler will use 
+   the given policy.
+   @see boot
+   */
+void boot_with_policy(unsigned int ncores, unsigned int terminals, sched_policy policy,
+	Task boot_task, int argl, void* args);
+
 
 /** @} */
 
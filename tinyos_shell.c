@@ -424,6 +424,7 @@ struct __rs_globals
 	/* used to log connection messages */
 	rlnode log;
 	size_t logcount;
+	RWLock log_lock;
 	
 	/* Synchronize with active threads */
 	Mutex mx;
@@ -576,10 +577,10 @@ static void log_message(void* __globals, const char* msg, ...)
 
 	/* Append the record */
 	logrec *rec = (logrec*) buffer;
-	Mutex_Lock(& GS(mx));
+	RW_WriteLock(& GS(log_lock));
 	rlnode_new(& rec->node)->num = ++GS(logcount);
 	rlist_push_back(& GS(log), & rec->node);
-	Mutex_Unlock(& GS(mx));
+	RW_WriteUnlock(& GS(log_lock));
 }
 
 /* init the log */
@@ -587,17 +588,18 @@ static void log_init(void* __globals)
 {
 	rlnode_init(& GS(log), NULL);
 	GS(logcount)=0;
+	GS(log_lock) = RWLOCK_INIT;
 }
 
 /* Print the log to the console */
 static void log_print(void* __globals)
 {
-	Mutex_Lock(& GS(mx));
+	RW_ReadLock(& GS(log_lock));
 	for(rlnode* ptr = GS(log).next; ptr != &GS(log); ptr=ptr->next) {
 		logrec *rec = (logrec*)ptr;
 		printf("%6d: %s\n", rec->node.num, rec->message);
 	}
-	Mutex_Unlock(& GS(mx));
+	RW_ReadUnlock(& GS(log_lock));
 }
 
 	
@@ -607,9 +609,9 @@ static void log_truncate(void* __globals)
 	rlnode list;
 	rlnode_init(&list, NULL);
 	
-	Mutex_Lock(& GS(mx));
+	RW_WriteLock(& GS(log_lock));
 	rlist_append(& list, &GS(log));
-	Mutex_Unlock(& GS(mx));
+	RW_WriteUnlock(& GS(log_lock));
 
 	/* Free the memory ! */
 	while(list.next != &list) {
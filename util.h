@@ -581,6 +581,230 @@ static inline void rlist_select(rlnode* Lsrc, rlnode* Ldest, int (*pred)(rlnode*
 
 
 
+/*******************************************************
+ *
+ *
+ *******************************************************/
+
+/**
+	@defgroup avltrees  AVL trees
+	@brief  An intrusive balanced binary search tree.
+
+	Like resource lists, AVL trees are intrusive: the @c avl_node is stored
+	inside the object, and the tree is ordered by a comparison function
+	on nodes, given when the tree is initialized. Nodes which compare equal 
+	are kept in insertion order.
+
+	For example, to keep TCBs ordered by some field @c key,
+	@code
+	static int key_less(avl_node* a, avl_node* b) { return a->tcb->key < b->tcb->key; }
+
+	avl_tree T;  avl_init(&T, key_less);
+
+	avl_node_init(& tcb->tree_node, tcb);
+	avl_insert(&T, & tcb->tree_node);
+	...
+	TCB* smallest = avl_first(&T)->tcb;
+	@endcode
+
+	Insertion and removal take logarithmic time. The smallest node is 
+	cached, so @c avl_first takes constant time.
+
+	@{
+ */
+
+/** @brief A node of an AVL tree */
+typedef struct avl_node {
+	/** @brief The key of the node (see @c rlnode) */
+	union {
+		TCB* tcb;
+		void* obj;
+		intptr_t num;
+	};
+	struct avl_node* left;		/**< @brief Left subtree */
+	struct avl_node* right;		/**< @brief Right subtree */
+	struct avl_node* parent;	/**< @brief Parent node, NULL for the root */
+	int height;					/**< @brief Height of the subtree */
+} avl_node;
+
+/** @brief An AVL tree */
+typedef struct avl_tree {
+	avl_node* root;		/**< @brief The root node */
+	avl_node* first;	/**< @brief The smallest node */
+	int (*less)(avl_node*, avl_node*); /**< @brief The node order */
+} avl_tree;
+
+/** @brief Initialize an empty tree with the given order */
+static inline avl_tree* avl_init(avl_tree* t, int (*less)(avl_node*, avl_node*))
+{
+	t->root = t->first = NULL;
+	t->less = less;
+	return t;
+}
+
+/** @brief Initialize a tree node with the given key */
+static inline avl_node* avl_node_init(avl_node* n, void* ptr)
+{
+	n->obj = ptr;
+	n->left = n->right = n->parent = NULL;
+	n->height = 0;
+	return n;
+}
+
+/** @brief Check a tree for emptiness */
+static inline int is_avl_empty(avl_tree* t) { return t->root == NULL; }
+
+/** @brief Return the smallest node of the tree, or NULL if the tree is empty */
+static inline avl_node* avl_first(avl_tree* t) { return t->first; }
+
+/** @brief Return the node after @c n in the tree order, or NULL */
+static inline avl_node* avl_next(avl_node* n)
+{
+	if(n->right) {
+		n = n->right;
+		while(n->left) n = n->left;
+		return n;
+	}
+	while(n->parent && n->parent->right == n) n = n->parent;
+	return n->parent;
+}
+
+/** @internal */
+static inline int avl_height(avl_node* n) { return n ? n->height : 0; }
+
+/** @internal */
+static inline void avl_update(avl_node* n) 
+{ 
+	int hl = avl_height(n->left), hr = avl_height(n->right);
+	n->height = 1 + (hl > hr ? hl : hr);
+}
+
+/** @internal Make @c n the child of @c parent in place of @c old */
+static inline void avl_replace_child(avl_tree* t, avl_node* parent, avl_node* old, avl_node* n)
+{
+	if(parent == NULL) t->root = n;
+	else if(parent->left == old) parent->left = n;
+	else parent->right = n;
+	if(n) n->parent = parent;
+}
+
+/** @internal */
+static inline avl_node* avl_rotate_left(avl_tree* t, avl_node* x)
+{
+	avl_node* y = x->right;
+	x->right = y->left;
+	if(y->left) y->left->parent = x;
+	avl_replace_child(t, x->parent, x, y);
+	y->left = x;  x->parent = y;
+	avl_update(x);  avl_update(y);
+	return y;
+}
+
+/** @internal */
+static inline avl_node* avl_rotate_right(avl_tree* t, avl_node* x)
+{
+	avl_node* y = x->left;
+	x->left = y->right;
+	if(y->right) y->right->parent = x;
+	avl_replace_child(t, x->parent, x, y);
+	y->right = x;  x->parent = y;
+	avl_update(x);  avl_update(y);
+	return y;
+}
+
+/** @internal Restore the balance on the path from @c n to the root */
+static inline void avl_rebalance(avl_tree* t, avl_node* n)
+{
+	while(n) {
+		avl_update(n);
+		int balance = avl_height(n->left) - avl_height(n->right);
+		if(balance > 1) {
+			if(avl_height(n->left->left) < avl_height(n->left->right))
+				avl_rotate_left(t, n->left);
+			n = avl_rotate_right(t, n);
+		} else if(balance < -1) {
+			if(avl_height(n->right->right) < avl_height(n->right->left))
+				avl_rotate_right(t, n->right);
+			n = avl_rotate_left(t, n);
+		}
+		n = n->parent;
+	}
+}
+
+/**
+	@brief Insert a node into the tree.
+
+	The node is placed after all the nodes that are not greater than it.
+	@pre @c n is not in any tree
+*/
+static inline void avl_insert(avl_tree* t, avl_node* n)
+{
+	avl_node* parent = NULL;
+	avl_node** link = &t->root;
+	int leftmost = 1;
+
+	while(*link) {
+		parent = *link;
+		if(t->less(n, parent))
+			link = &parent->left;
+		else {
+			link = &parent->right;
+			leftmost = 0;
+		}
+	}
+
+	n->left = n->right = NULL;
+	n->parent = parent;
+	n->height = 1;
+	*link = n;
+
+	if(leftmost) t->first = n;
+	avl_rebalance(t, parent);
+}
+
+/**
+	@brief Remove a node from the tree.
+	@pre @c n is in tree @c t
+*/
+static inline void avl_remove(avl_tree* t, avl_node* n)
+{
+	avl_node* rebalance_from;
+
+	/* The smallest node has no left child, so its successor is easy to find */
+	if(t->first == n) t->first = avl_next(n);
+
+	if(n->left && n->right) {
+		/* Put the successor of n in its place */
+		avl_node* s = n->right;
+		while(s->left) s = s->left;
+
+		if(s->parent != n) {
+			rebalance_from = s->parent;
+			s->parent->left = s->right;
+			if(s->right) s->right->parent = s->parent;
+			s->right = n->right;
+			n->right->parent = s;
+		} else
+			rebalance_from = s;
+
+		s->left = n->left;
+		n->left->parent = s;
+		avl_replace_child(t, n->parent, n, s);
+		s->height = n->height;
+	} else {
+		rebalance_from = n->parent;
+		avl_replace_child(t, n->parent, n, n->left ? n->left : n->right);
+	}
+
+	n->left = n->right = n->parent = NULL;
+	n->height = 0;
+	avl_rebalance(t, rebalance_from);
+}
+
+/* @} avltrees */
+
+
+
 /*
 	Some helpers for packing and unpacking vectors of strings into
 	(argl, args)
@@ -5,8 +5,10 @@
 #include <time.h>
 #include <math.h>
 #include <setjmp.h>
+#include <sched.h>
 
 #include "util.h"
+#include "bios.h"
 #include "symposium.h"
 #include "tinyoslib.h"
 #include "unit_testing.h"
@@ -2597,11 +2599,1141 @@ BARE_TEST(dummy_user_test,
 }
 
 
+static int create_thread_stack_task(int argl, void* args)
+{
+	/* Touch every page of a buffer of argl bytes on the stack */
+	volatile char buf[argl];
+	for(int i=0; i<argl; i+=1024) buf[i] = 1;
+	int sum = 0;
+	for(int i=0; i<argl; i+=1024) sum += buf[i];
+	return sum;
+}
+
+BOOT_TEST(test_create_thread_stack,
+	"Test that threads can be created with a given stack size, and that "
+	"illegal stack sizes are rejected."
+	)
+{
+	ASSERT(CreateThreadStack(create_thread_stack_task, 0, NULL, 1)==NOTHREAD);
+	ASSERT(CreateThreadStack(create_thread_stack_task, 0, NULL, THREAD_STACK_MIN-1)==NOTHREAD);
+	ASSERT(CreateThreadStack(create_thread_stack_task, 0, NULL, THREAD_STACK_MAX+1)==NOTHREAD);
+
+	int sizes[] = { 8*1024, 100*1024, 1024*1024 };
+	unsigned int stacks[] = { THREAD_STACK_MIN, 0, 2*1024*1024 };
+
+	for(int i=0; i<3; i++) {
+		Tid_t t = CreateThreadStack(create_thread_stack_task, sizes[i], NULL, stacks[i]);
+		ASSERT(t!=NOTHREAD);
+		int exitval;
+		ASSERT(ThreadJoin(t, &exitval)==0);
+		ASSERT(exitval == (sizes[i]+1023)/1024);
+	}
+	return 0;
+}
+
+
+#define SCHED_POLICY_SPINNERS 4
+#define SCHED_POLICY_ROUNDS 20
+static volatile int sched_policy_stop;
+static volatile unsigned long sched_policy_progress[SCHED_POLICY_SPINNERS];
+
+static int sched_policy_spinner(int argl, void* args)
+{
+	while(! sched_policy_stop)
+		sched_policy_progress[argl]++;
+	return argl;
+}
+
+static Mutex sched_policy_mx = MUTEX_INIT;
+static CondVar sched_policy_cv = COND_INIT;
+static volatile int sched_policy_turn;
+
+static int sched_policy_echo(int argl, void* args)
+{
+	/* Bounce the turn back to the main thread argl times */
+	Mutex_Lock(&sched_policy_mx);
+	for(int i=0; i<argl; i++) {
+		while(sched_policy_turn != 1)
+			Cond_Wait(&sched_policy_mx, &sched_policy_cv);
+		sched_policy_turn = 0;
+		Cond_Broadcast(&sched_policy_cv);
+	}
+	Mutex_Unlock(&sched_policy_mx);
+	return 0;
+}
+
+static int sched_policy_boot(int argl, void* args)
+{
+	sched_policy_stop = 0;
+	sched_policy_turn = 0;
+	for(int i=0; i<SCHED_POLICY_SPINNERS; i++) sched_policy_progress[i] = 0;
+
+	Tid_t spinner[SCHED_POLICY_SPINNERS];
+	for(int i=0; i<SCHED_POLICY_SPINNERS; i++) {
+		spinner[i] = CreateThread(sched_policy_spinner, i, NULL);
+		ASSERT(spinner[i] != NOTHREAD);
+	}
+
+	/* Ping-pong with a blocking thread, competing with the spinners */
+	Tid_t echo = CreateThread(sched_policy_echo, SCHED_POLICY_ROUNDS, NULL);
+	ASSERT(echo != NOTHREAD);
+	Mutex_Lock(&sched_policy_mx);
+	for(int i=0; i<SCHED_POLICY_ROUNDS; i++) {
+		sched_policy_turn = 1;
+		Cond_Broadcast(&sched_policy_cv);
+		while(sched_policy_turn != 0)
+			Cond_Wait(&sched_policy_mx, &sched_policy_cv);
+	}
+	Mutex_Unlock(&sched_policy_mx);
+	ASSERT(ThreadJoin(echo, NULL)==0);
+
+	/* Every spinner must have made progress */
+	for(int i=0; i<SCHED_POLICY_SPINNERS; i++)
+		while(sched_policy_progress[i] == 0)
+			;
+	sched_policy_stop = 1;
+
+	for(int i=0; i<SCHED_POLICY_SPINNERS; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(spinner[i], &exitval)==0);
+		ASSERT(exitval == i);
+	}
+	return 0;
+}
+
+BARE_TEST(test_sched_policies,
+	"Test that the kernel runs threads to completion under every scheduling policy."
+	)
+{
+	sched_policy policies[] = { SCHED_POLICY_MLFQ, SCHED_POLICY_CFS, SCHED_POLICY_RR };
+	for(int p=0; p<3; p++)
+		for(uint ncores=1; ncores<=2; ncores++)
+			boot_with_policy(ncores, 0, policies[p], sched_policy_boot, 0, NULL);
+}
+
+
+static volatile int rt_stop;
+static volatile unsigned long rt_progress;
+
+static int rt_spinner(int argl, void* args)
+{
+	while(! rt_stop)
+		rt_progress++;
+	return 0;
+}
+
+static int rt_hog(int argl, void* args)
+{
+	struct timeval t0;
+	mark_time(&t0);
+	while(time_since(&t0) < 0.2)
+		;
+	return 0;
+}
+
+static int thread_rt_boot(int argl, void* args)
+{
+	Tid_t self = ThreadSelf();
+
+	/* Bad parameters */
+	ASSERT(SetThreadRT(NOTHREAD, 2000, 10000, 0)==-1);
+	ASSERT(SetThreadRT(self, 500, 10000, 0)==-1);
+	ASSERT(SetThreadRT(self, 5000, 4000, 0)==-1);
+	ASSERT(SetThreadRT(self, 5000, 10000, 4000)==-1);
+	ASSERT(SetThreadRT(self, 5000, 10000, 20000)==-1);
+	ASSERT(GetThreadDeadlineMisses(NOTHREAD)==-1);
+	ASSERT(GetThreadDeadlineMisses(self)==0);
+
+	/* Admission control */
+	rt_stop = 0;
+	rt_progress = 0;
+	Tid_t spinner = CreateThread(rt_spinner, 0, NULL);
+	ASSERT(SetThreadRT(self, 8000, 10000, 0)==0);
+	ASSERT(SetThreadRT(spinner, 2000, 10000, 0)==-1);
+	ASSERT(SetThreadRT(self, 5000, 10000, 0)==0);
+	ASSERT(SetThreadRT(spinner, 2000, 10000, 0)==0);
+	ASSERT(SetThreadRT(spinner, 0, 0, 0)==0);
+	ASSERT(SetThreadRT(self, 0, 0, 0)==0);
+
+	/* 
+		A real-time hog is throttled, so the spinner still runs. The hog 
+		does not block by its deadlines.
+	*/
+	Tid_t hog = CreateThread(rt_hog, 0, NULL);
+	ASSERT(SetThreadRT(hog, 2000, 10000, 5000)==0);
+	unsigned long progress = rt_progress;
+	struct timeval t0;
+	mark_time(&t0);
+	while(time_since(&t0) < 0.1)
+		;
+	ASSERT(rt_progress > progress);
+	ASSERT(GetThreadDeadlineMisses(hog) > 0);
+	ASSERT(ThreadJoin(hog, NULL)==0);
+
+	rt_stop = 1;
+	ASSERT(ThreadJoin(spinner, NULL)==0);
+	ASSERT(GetThreadDeadlineMisses(spinner)==-1);
+	return 0;
+}
+
+BARE_TEST(test_thread_rt,
+	"Test the real-time threads: parameter checks, admission control, throttling and deadline misses."
+	)
+{
+	/* The admission checks assume a single core */
+	boot(1, 0, thread_rt_boot, 0, NULL);
+}
+
+
+static int nice_child(int argl, void* args)
+{
+	int nice;
+	ASSERT(GetNice(NOPROC, &nice)==0);
+	ASSERT(nice == argl);
+	ASSERT(GetNice(GetPPid(), &nice)==-1);
+	ASSERT(SetNice(GetPPid(), 0)==-1);
+	return 0;
+}
+
+static volatile int nice_stop;
+static volatile unsigned long nice_progress[2];
+
+static int nice_spinner(int argl, void* args)
+{
+	while(! nice_stop)
+		nice_progress[argl]++;
+	return 0;
+}
+
+static int thread_priority_boot(int argl, void* args)
+{
+	Tid_t self = ThreadSelf();
+
+	/* Thread priorities */
+	ASSERT(GetThreadPriority(self)==THREAD_PRIORITY_DEFAULT);
+	ASSERT(SetThreadPriority(self, THREAD_PRIORITY_MAX+1)==-1);
+	ASSERT(SetThreadPriority(self, THREAD_PRIORITY_MIN-1)==-1);
+	ASSERT(SetThreadPriority(NOTHREAD, THREAD_PRIORITY_MIN)==-1);
+	ASSERT(GetThreadPriority(NOTHREAD)==-1);
+	ASSERT(SetThreadPriority(self, THREAD_PRIORITY_MAX)==0);
+	ASSERT(GetThreadPriority(self)==THREAD_PRIORITY_MAX);
+
+	/* Nice values, inherited by children */
+	int nice;
+	ASSERT(GetNice(NOPROC, &nice)==0 && nice==0);
+	ASSERT(SetNice(NOPROC, NICE_MAX+1)==-1);
+	ASSERT(SetNice(NOPROC, NICE_MIN-1)==-1);
+	ASSERT(SetNice(NOPROC, 5)==0);
+	ASSERT(GetNice(GetPid(), &nice)==0 && nice==5);
+	Pid_t child = Exec(nice_child, 5, NULL);
+	ASSERT(WaitChild(child, NULL)==child);
+	ASSERT(SetNice(NOPROC, 0)==0);
+
+	/* A process with a low nice value gets more time than one with a high nice value */
+	nice_stop = 0;
+	nice_progress[0] = nice_progress[1] = 0;
+	Pid_t fast = Exec(nice_spinner, 0, NULL);
+	Pid_t slow = Exec(nice_spinner, 1, NULL);
+	ASSERT(SetNice(fast, NICE_MIN)==0);
+	ASSERT(SetNice(slow, NICE_MAX)==0);
+	ASSERT(GetNice(slow, &nice)==0 && nice==NICE_MAX);
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 200);
+	Mutex_Unlock(&mx);
+	nice_stop = 1;
+	ASSERT(WaitChild(fast, NULL)==fast);
+	ASSERT(WaitChild(slow, NULL)==slow);
+	ASSERT(nice_progress[0] > nice_progress[1]);
+
+	return 0;
+}
+
+BARE_TEST(test_thread_priority,
+	"Test the thread priorities and the nice values of processes."
+	)
+{
+	boot(1, 0, thread_priority_boot, 0, NULL);
+}
+
+
+static volatile int affinity_stop;
+static volatile int affinity_violations;
+
+/* Not inlined, so that the core id is read again after a thread moves */
+static __attribute__((noinline)) uint affinity_core()
+{
+	return cpu_core_id;
+}
+
+static int affinity_pinned(int argl, void* args)
+{
+	ASSERT(SetAffinity(ThreadSelf(), cpumask_of(argl))==0);
+
+	/* The thread moves to its core when it is next scheduled */
+	while(affinity_core() != argl)
+		;
+
+	while(! affinity_stop) {
+		if(affinity_core() != argl)
+			affinity_violations++;
+	}
+	return 0;
+}
+
+static int affinity_boot(int argl, void* args)
+{
+	Tid_t self = ThreadSelf();
+	cpumask_t mask;
+
+	ASSERT(GetAffinity(self, &mask)==0);
+	ASSERT(cpumask_equal(mask, cpumask_first_n(4)));
+	ASSERT(SetAffinity(self, cpumask_none())==-1);
+	ASSERT(SetAffinity(self, cpumask_of(5))==-1);
+	ASSERT(SetAffinity(NOTHREAD, cpumask_of(0))==-1);
+	ASSERT(GetAffinity(NOTHREAD, &mask)==-1);
+	ASSERT(SetAffinity(self, CPUMASK_ALL)==0);
+
+	/* Pin threads to cores 1 to 3, and keep the main thread off them */
+	affinity_stop = 0;
+	affinity_violations = 0;
+	ASSERT(SetAffinity(self, cpumask_of(0))==0);
+	ASSERT(GetAffinity(self, &mask)==0 && cpumask_equal(mask, cpumask_of(0)));
+	while(affinity_core() != 0)
+		;
+	Tid_t pinned[3];
+	for(int i=0; i<3; i++)
+		pinned[i] = CreateThread(affinity_pinned, i+1, NULL);
+
+	struct timeval t0;
+	mark_time(&t0);
+	while(time_since(&t0) < 0.2)
+		ASSERT(affinity_core() == 0);
+
+	affinity_stop = 1;
+	for(int i=0; i<3; i++)
+		ASSERT(ThreadJoin(pinned[i], NULL)==0);
+	ASSERT(affinity_violations == 0);
+	return 0;
+}
+
+BARE_TEST(test_affinity,
+	"Test that threads only run on the cores of their affinity."
+	)
+{
+	boot(4, 0, affinity_boot, 0, NULL);
+}
+
+
+static int wide_affinity_boot(int argl, void* args)
+{
+	cpumask_t mask;
+	ASSERT(GetAffinity(ThreadSelf(), &mask)==0);
+	ASSERT(cpumask_equal(mask, cpumask_first_n(MAX_CORES)));
+	ASSERT(cpumask_first(mask)==0);
+
+	/* Visit cores in both words of the masks, and the last core */
+	uint cores[] = { 63, 64, 100, MAX_CORES-1, 0 };
+	for(int i=0; i < sizeof(cores)/sizeof(uint); i++) {
+		ASSERT(SetAffinity(ThreadSelf(), cpumask_of(cores[i]))==0);
+		while(affinity_core() != cores[i])
+			;
+	}
+	return 0;
+}
+
+BARE_TEST(test_wide_affinity,
+	"Test affinity on a machine with MAX_CORES cores."
+	)
+{
+	boot(MAX_CORES, 0, wide_affinity_boot, 0, NULL);
+}
+
+
+static volatile int balance_stop;
+static volatile int balance_moved;
+
+static int balance_spinner(int argl, void* args)
+{
+	while(! balance_stop)
+		if(affinity_core() != argl)
+			balance_moved = 1;
+	return 0;
+}
+
+static int balance_boot(int argl, void* args)
+{
+	balance_stop = 0;
+	balance_moved = 0;
+
+	/* Core 0 runs a single pinned thread */
+	Tid_t pinned = CreateThread(balance_spinner, 0, NULL);
+	ASSERT(SetAffinity(pinned, cpumask_of(0))==0);
+
+	/* Core 1 time-shares four threads */
+	ASSERT(SetAffinity(ThreadSelf(), cpumask_of(1))==0);
+	while(affinity_core() != 1)
+		;
+	Tid_t spinner[4];
+	for(int i=0; i<4; i++)
+		spinner[i] = CreateThread(balance_spinner, 1, NULL);
+	ASSERT(SetAffinity(ThreadSelf(), CPUMASK_ALL)==0);
+
+	/* Core 0 never becomes idle, but the balancer moves threads to it */
+	struct timeval t0;
+	mark_time(&t0);
+	while(! balance_moved && time_since(&t0) < 1.0) {
+		Mutex mx = MUTEX_INIT;
+		CondVar cv = COND_INIT;
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 10);
+		Mutex_Unlock(&mx);
+	}
+	ASSERT(balance_moved);
+
+	balance_stop = 1;
+	for(int i=0; i<4; i++)
+		ASSERT(ThreadJoin(spinner[i], NULL)==0);
+	ASSERT(ThreadJoin(pinned, NULL)==0);
+	return 0;
+}
+
+BARE_TEST(test_load_balance,
+	"Test that the balancer moves threads to a busy core with less load."
+	)
+{
+	boot(2, 0, balance_boot, 0, NULL);
+}
+
+
+static volatile int parking_stop;
+static volatile uint parking_seen;
+
+static int parking_spinner(int argl, void* args)
+{
+	while(! parking_stop)
+		__atomic_fetch_or(&parking_seen, 1u << affinity_core(), __ATOMIC_RELAXED);
+	return 0;
+}
+
+static int parking_boot(int argl, void* args)
+{
+	/* Stay quiet for a while, so that the idle cores are parked */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 500);
+	Mutex_Unlock(&mx);
+
+	/* A load spike unparks the cores */
+	parking_stop = 0;
+	parking_seen = 0;
+	Tid_t spinner[8];
+	for(int i=0; i<8; i++)
+		spinner[i] = CreateThread(parking_spinner, 0, NULL);
+
+	struct timeval t0;
+	mark_time(&t0);
+	while(__builtin_popcount(parking_seen) < 3 && time_since(&t0) < 2.0) {
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 10);
+		Mutex_Unlock(&mx);
+	}
+
+	/* 
+		The core of this thread, and the parked cores. (A halted core is only 
+		restarted if the host has cpus to spare, but a parked core is unparked.)
+	*/
+	ASSERT(__builtin_popcount(parking_seen) >= 3);
+
+	parking_stop = 1;
+	for(int i=0; i<8; i++)
+		ASSERT(ThreadJoin(spinner[i], NULL)==0);
+	return 0;
+}
+
+BARE_TEST(test_core_parking,
+	"Test that parked cores are unparked when the load rises."
+	)
+{
+	boot(4, 0, parking_boot, 0, NULL);
+}
+
+
+static Mutex pi_mutex = MUTEX_INIT;
+static volatile int pi_locked;
+static volatile int pi_stop;
+
+static void pi_spin(double sec)
+{
+	struct timeval t0;
+	mark_time(&t0);
+	while(time_since(&t0) < sec)
+		;
+}
+
+static int pi_low(int argl, void* args)
+{
+	Mutex_Lock(&pi_mutex);
+	pi_locked = 1;
+	pi_spin(0.05);
+	Mutex_Unlock(&pi_mutex);
+	return 0;
+}
+
+static int pi_hog(int argl, void* args)
+{
+	while(! pi_stop)
+		;
+	return 0;
+}
+
+static int priority_inheritance_boot(int argl, void* args)
+{
+	/* The hogs and this thread never drop below the level the low thread can reach */
+	ASSERT(SetNice(NOPROC, NICE_MIN)==0);
+	ASSERT(SetThreadPriority(ThreadSelf(), THREAD_PRIORITY_MAX)==0);
+
+	pi_locked = 0;
+	pi_stop = 0;
+	Pid_t low = Exec(pi_low, 0, NULL);
+	ASSERT(SetNice(low, NICE_MAX)==0);
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	while(! pi_locked) {
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 1);
+		Mutex_Unlock(&mx);
+	}
+
+	Pid_t hog[2];
+	for(int i=0; i<2; i++)
+		hog[i] = Exec(pi_hog, 0, NULL);
+
+	/* The low thread inherits our priority, and releases the mutex soon */
+	struct timeval t0;
+	mark_time(&t0);
+	Mutex_Lock(&pi_mutex);
+	double waited = time_since(&t0);
+	Mutex_Unlock(&pi_mutex);
+
+	pi_stop = 1;
+	for(int i=0; i<2; i++)
+		ASSERT(WaitChild(hog[i], NULL)==hog[i]);
+	ASSERT(WaitChild(low, NULL)==low);
+	ASSERT(waited < 0.5);
+	return 0;
+}
+
+BARE_TEST(test_priority_inheritance,
+	"Test that the owner of a mutex inherits the priority of its waiters."
+	)
+{
+	boot(1, 0, priority_inheritance_boot, 0, NULL);
+}
+
+
+static volatile int pinned_host_cpu;
+
+static void pinned_core_boot()
+{
+	pinned_host_cpu = sched_getcpu();
+}
+
+BARE_TEST(test_host_cpu_pinning,
+	"Test that a core can be pinned to a host cpu."
+	)
+{
+	vm_config vmc;
+	vm_configure(&vmc, pinned_core_boot, 1, 0);
+	vmc.pin_host_cpus = 1;
+	vmc.host_cpu[0] = 0;
+	vmc.pic_host_cpu = -1;
+
+	pinned_host_cpu = -1;
+	vm_run(&vmc);
+	ASSERT(pinned_host_cpu == 0);
+
+	/* A host cpu out of range leaves the core unpinned */
+	vmc.host_cpu[0] = CPU_SETSIZE;
+	pinned_host_cpu = -1;
+	vm_run(&vmc);
+	ASSERT(pinned_host_cpu >= 0);
+}
+
+
+static int fg_child(int argl, void* args)
+{
+	return argl;
+}
+
+static int fg_pipe_loop(int argl, void* args)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+
+	char out[64], in[64];
+	for(int i=0; i<200; i++) {
+		for(int j=0; j<64; j++)
+			out[j] = (char)(argl + i + j);
+		ASSERT(Write(p.write, out, 64)==64);
+		ASSERT(Read(p.read, in, 64)==64);
+		ASSERT(memcmp(in, out, 64)==0);
+	}
+
+	ASSERT(Close(p.write)==0);
+	ASSERT(Read(p.read, in, 64)==0);
+	ASSERT(Close(p.read)==0);
+	return 0;
+}
+
+static int fine_grained_boot(int argl, void* args)
+{
+	/* Threads on their own pipes, while processes come and go */
+	Tid_t t[4];
+	for(int i=0; i<4; i++)
+		t[i] = CreateThread(fg_pipe_loop, i, NULL);
+
+	for(int i=0; i<50; i++) {
+		Pid_t pid = Exec(fg_child, i, NULL);
+		ASSERT(pid != NOPROC);
+		int status;
+		ASSERT(WaitChild(pid, &status)==pid);
+		ASSERT(status == i);
+	}
+
+	for(int i=0; i<4; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(t[i], &exitval)==0);
+		ASSERT(exitval == 0);
+	}
+	return 0;
+}
+
+BARE_TEST(test_fine_grained_locking,
+	"Test that system calls on unrelated kernel objects run concurrently and correctly."
+	)
+{
+	boot(4, 0, fine_grained_boot, 0, NULL);
+}
+
+
+static SleepMutex sm_lock = SLEEPMUTEX_INIT;
+static volatile int sm_counter;
+
+static int sm_worker(int argl, void* args)
+{
+	for(int i=0; i<20000; i++) {
+		SleepMutex_Lock(&sm_lock);
+		sm_counter++;
+		SleepMutex_Unlock(&sm_lock);
+	}
+	return 0;
+}
+
+static int sleep_mutex_boot(int argl, void* args)
+{
+	/* A held mutex cannot be taken */
+	ASSERT(SleepMutex_TryLock(&sm_lock)==1);
+	ASSERT(SleepMutex_TryLock(&sm_lock)==0);
+
+	sm_counter = 0;
+	Tid_t t[4];
+	for(int i=0; i<4; i++)
+		t[i] = CreateThread(sm_worker, 0, NULL);
+
+	/* Hold the mutex while we sleep, so the workers must sleep too */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 50);
+	Mutex_Unlock(&mx);
+	ASSERT(sm_counter == 0);
+	SleepMutex_Unlock(&sm_lock);
+
+	for(int i=0; i<4; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	ASSERT(sm_counter == 4*20000);
+	ASSERT(sm_lock == SLEEPMUTEX_INIT);
+	return 0;
+}
+
+BARE_TEST(test_sleep_mutex,
+	"Test that threads sleep on a locked SleepMutex, and take it in turn."
+	)
+{
+	boot(2, 0, sleep_mutex_boot, 0, NULL);
+}
+
+
+static RWLock rw_lock = RWLOCK_INIT;
+static volatile int rw_value[2];
+static volatile int rw_readers, rw_stop;
+
+static int rw_reader(int argl, void* args)
+{
+	int reads = 0;
+	while(! rw_stop) {
+		RW_ReadLock(&rw_lock);
+		__atomic_add_fetch(&rw_readers, 1, __ATOMIC_SEQ_CST);
+		/* A writer never runs concurrently with us */
+		ASSERT(rw_value[0] == rw_value[1]);
+		__atomic_sub_fetch(&rw_readers, 1, __ATOMIC_SEQ_CST);
+		RW_ReadUnlock(&rw_lock);
+		reads++;
+	}
+	return reads;
+}
+
+static int rw_writer(int argl, void* args)
+{
+	for(int i=0; i<2000; i++) {
+		RW_WriteLock(&rw_lock);
+		ASSERT(rw_readers == 0);
+		rw_value[0]++;
+		rw_value[1]++;
+		RW_WriteUnlock(&rw_lock);
+	}
+	return 0;
+}
+
+static int rwlock_boot(int argl, void* args)
+{
+	/* Many readers at once */
+	RW_ReadLock(&rw_lock);
+	RW_ReadLock(&rw_lock);
+	ASSERT(rw_lock.state == 2);
+	RW_ReadUnlock(&rw_lock);
+	RW_ReadUnlock(&rw_lock);
+
+	rw_value[0] = rw_value[1] = 0;
+	rw_readers = rw_stop = 0;
+
+	Tid_t r[3], w[2];
+	for(int i=0; i<3; i++)
+		r[i] = CreateThread(rw_reader, 0, NULL);
+	for(int i=0; i<2; i++)
+		w[i] = CreateThread(rw_writer, 0, NULL);
+
+	/* The writers are not starved by the readers */
+	for(int i=0; i<2; i++)
+		ASSERT(ThreadJoin(w[i], NULL)==0);
+	rw_stop = 1;
+	for(int i=0; i<3; i++)
+		ASSERT(ThreadJoin(r[i], NULL)==0);
+
+	ASSERT(rw_value[0] == 4000);
+	ASSERT(rw_lock.state == 0);
+	return 0;
+}
+
+BARE_TEST(test_rwlock,
+	"Test that an RWLock excludes writers from readers, and does not starve writers."
+	)
+{
+	boot(4, 0, rwlock_boot, 0, NULL);
+}
+
+
+static Mutex bar_mx = MUTEX_INIT;
+static CondVar bar_cv = COND_INIT;
+static volatile int bar_count, bar_round;
+
+/* A barrier, where the last thread to arrive broadcasts */
+static void barrier_wait(int nthreads, int timed)
+{
+	Mutex_Lock(&bar_mx);
+	int round = bar_round;
+	if(++bar_count == nthreads) {
+		bar_count = 0;
+		bar_round++;
+		Cond_Broadcast(&bar_cv);
+	}
+	else while(bar_round == round) {
+		if(timed)
+			Cond_TimedWait(&bar_mx, &bar_cv, 1);
+		else
+			Cond_Wait(&bar_mx, &bar_cv);
+	}
+	Mutex_Unlock(&bar_mx);
+}
+
+static int barrier_thread(int argl, void* args)
+{
+	for(int i=0; i<300; i++)
+		barrier_wait(6, argl);
+	return 0;
+}
+
+static int broadcast_morphing_boot(int argl, void* args)
+{
+	bar_count = bar_round = 0;
+	Tid_t t[6];
+	for(int i=0; i<6; i++)
+		t[i] = CreateThread(barrier_thread, i % 2, NULL);
+	for(int i=0; i<6; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	ASSERT(bar_round == 300);
+	ASSERT(bar_mx == MUTEX_INIT);
+	return 0;
+}
+
+BARE_TEST(test_broadcast_morphing,
+	"Test that all the waiters of a broadcast get the mutex, including the ones that time out."
+	)
+{
+	boot(2, 0, broadcast_morphing_boot, 0, NULL);
+}
+
+
+static Fid_t irq_term;
+static volatile int irq_readers, irq_done;
+static char irq_bytes[4];
+static SleepMutex irq_sm = SLEEPMUTEX_INIT;
+
+static int irq_reader(int argl, void* args)
+{
+	__atomic_add_fetch(&irq_readers, 1, __ATOMIC_SEQ_CST);
+	ASSERT(Read(irq_term, &irq_bytes[argl], 1)==1);
+	return 0;
+}
+
+/* Keep the futex table busy, while the readers are woken up */
+static int irq_futex_load(int argl, void* args)
+{
+	while(! irq_done) {
+		SleepMutex_Lock(&irq_sm);
+		SleepMutex_Unlock(&irq_sm);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_broadcast_from_interrupt,
+	"Test that many readers of a terminal, woken up together by the keyboard\n"
+	"interrupt handler, all get their bytes.",
+	.minimum_terminals = 1
+	)
+{
+	irq_term = OpenTerminal(0);
+	ASSERT(irq_term!=NOFILE);
+	irq_readers = irq_done = 0;
+
+	Tid_t load[2];
+	for(int i=0; i<2; i++)
+		load[i] = CreateThread(irq_futex_load, 0, NULL);
+
+	Tid_t t[4];
+	for(int i=0; i<4; i++)
+		t[i] = CreateThread(irq_reader, i, NULL);
+
+	/* Give the readers time to go to sleep in the driver */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	while(irq_readers < 4)
+		Cond_TimedWait(&mx, &cv, 10);
+	Cond_TimedWait(&mx, &cv, 50);
+	Mutex_Unlock(&mx);
+
+	sendme(0, "abcd");
+	for(int i=0; i<4; i++)
+		ASSERT(ThreadJoin(t[i], NULL)==0);
+	irq_done = 1;
+	for(int i=0; i<2; i++)
+		ASSERT(ThreadJoin(load[i], NULL)==0);
+
+	/* Each byte was read exactly once */
+	int seen = 0;
+	for(int i=0; i<4; i++)
+		seen |= 1 << (irq_bytes[i]-'a');
+	ASSERT(seen == 0xf);
+	return 0;
+}
+
+
+static int connect_closed_socket(int argl, void* args)
+{
+	ASSERT(Connect(argl, 100, 10000000)==-1);
+	return 0;
+}
+
+static int connect_open_socket(int argl, void* args)
+{
+	ASSERT(Connect(argl, 100, 10000000)==0);
+	return 0;
+}
+
+BOOT_TEST(test_accept_skips_closed_requester,
+	"Test that Accept does not admit a request whose socket was closed\n"
+	"while Connect was waiting, but serves the next request."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli1 = Socket(NOPORT);
+	ASSERT(cli1!=NOFILE);
+	Tid_t t1 = CreateThread(connect_closed_socket, cli1, NULL);
+
+	/* Let the first Connect queue its request, then close its fid */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 50);
+	Mutex_Unlock(&mx);
+	ASSERT(Close(cli1)==0);
+
+	Fid_t cli2 = Socket(NOPORT);
+	ASSERT(cli2!=NOFILE);
+	Tid_t t2 = CreateThread(connect_open_socket, cli2, NULL);
+
+	Fid_t srv = Accept(lsock);
+	ASSERT(srv!=NOFILE);
+	ASSERT(ThreadJoin(t1, NULL)==0);
+	ASSERT(ThreadJoin(t2, NULL)==0);
+
+	/* The accepted socket is connected to the second client */
+	ASSERT(Write(srv, "hello", 6)==6);
+	char buffer[6];
+	ASSERT(Read(cli2, buffer, 6)==6);
+	ASSERT(strcmp(buffer, "hello")==0);
+	return 0;
+}
+
+
+static volatile int hr_ready, hr_received;
+
+static int handoff_reader(int argl, void* args)
+{
+	/* Start on the other core than the writer */
+	ASSERT(SetAffinity(ThreadSelf(), cpumask_of(1))==0);
+	ASSERT(SetAffinity(ThreadSelf(), cpumask_all())==0);
+	hr_ready = 1;
+
+	char c;
+	while(Read(argl, &c, 1)==1)
+		hr_received++;
+	return 0;
+}
+
+static int handoff_starvation_boot(int argl, void* args)
+{
+	const int N = 20;
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	hr_ready = hr_received = 0;
+	ASSERT(SetAffinity(ThreadSelf(), cpumask_of(0))==0);
+	Tid_t t = CreateThread(handoff_reader, p.read, NULL);
+
+	/* Sleep until the reader has moved to core 1 */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	while(! hr_ready)
+		Cond_TimedWait(&mx, &cv, 10);
+	Mutex_Unlock(&mx);
+
+	/* 
+		The writer never blocks: after each byte, it spins until the reader
+		gets it. The reader must not wait for the quantum of the writer.
+		(The spinning writer yields the host cpu, so that the other core 
+		can run even on a small host.)
+	*/
+	struct timeval t0;
+	mark_time(&t0);
+	for(int i=0; i<N; i++) {
+		ASSERT(Write(p.write, "x", 1)==1);
+		while(hr_received <= i)
+			sched_yield();
+	}
+	double elapsed = time_since(&t0);
+	ASSERT(elapsed < N * 0.005);	/* half the quantum per byte */
+
+	Close(p.write);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(hr_received == N);
+	return 0;
+}
+
+BARE_TEST(test_handoff_no_starvation,
+	"Test that a pipe reader is not stuck behind a writer that never blocks."
+	)
+{
+	boot(2, 0, handoff_starvation_boot, 0, NULL);
+}
+
+
+static Mutex rt_adm_mx = MUTEX_INIT;
+static CondVar rt_adm_cv = COND_INIT;
+static int rt_adm_stop;
+
+static int rt_admission_waiter(int argl, void* args)
+{
+	Mutex_Lock(&rt_adm_mx);
+	while(!rt_adm_stop)
+		Cond_Wait(&rt_adm_mx, &rt_adm_cv);
+	Mutex_Unlock(&rt_adm_mx);
+	return 0;
+}
+
+static int rt_admission_boot(int argl, void* args)
+{
+	rt_adm_stop = 0;
+	Tid_t t1 = CreateThread(rt_admission_waiter, 0, NULL);
+	Tid_t t2 = CreateThread(rt_admission_waiter, 0, NULL);
+	ASSERT(SetAffinity(t1, cpumask_of(0))==0);
+	ASSERT(SetAffinity(t2, cpumask_of(0))==0);
+
+	/* The bandwidth of core 0 is not shared with core 1 */
+	ASSERT(SetThreadRT(t1, 8000, 10000, 0)==0);
+	ASSERT(SetThreadRT(t2, 8000, 10000, 0)==-1);
+
+	/* Core 1 has room for t2, once it may run there */
+	ASSERT(SetAffinity(t2, cpumask_all())==0);
+	ASSERT(SetThreadRT(t2, 8000, 10000, 0)==0);
+
+	/* Each thread now runs only on the core it was admitted to */
+	ASSERT(SetAffinity(t1, cpumask_of(1))==-1);
+	ASSERT(SetAffinity(t2, cpumask_of(0))==-1);
+	ASSERT(SetAffinity(t2, cpumask_of(1))==0);
+
+	/* Dropping the real-time class gives the bandwidth back */
+	ASSERT(SetThreadRT(t1, 0, 0, 0)==0);
+	ASSERT(SetAffinity(t1, cpumask_of(1))==0);
+	ASSERT(SetAffinity(t2, cpumask_all())==0);
+	ASSERT(SetThreadRT(t1, 2000, 10000, 0)==-1);
+	ASSERT(SetAffinity(t1, cpumask_all())==0);
+	ASSERT(SetThreadRT(t1, 2000, 10000, 0)==0);
+
+	Mutex_Lock(&rt_adm_mx);
+	rt_adm_stop = 1;
+	Cond_Broadcast(&rt_adm_cv);
+	Mutex_Unlock(&rt_adm_mx);
+	ASSERT(ThreadJoin(t1, NULL)==0);
+	ASSERT(ThreadJoin(t2, NULL)==0);
+
+	/* Exited threads give their bandwidth back */
+	ASSERT(SetThreadRT(ThreadSelf(), 8000, 10000, 0)==0);
+	ASSERT(SetThreadRT(ThreadSelf(), 0, 0, 0)==0);
+	return 0;
+}
+
+BARE_TEST(test_rt_admission_per_core,
+	"Test that real-time threads are admitted to the bandwidth of a single core."
+	)
+{
+	boot(2, 0, rt_admission_boot, 0, NULL);
+}
+
+static Mutex slice_mx = MUTEX_INIT;
+static CondVar slice_cv = COND_INIT;
+static int slice_go, slice_woken, slice_stop;
+static struct timeval slice_wake_time;
+
+/* Wait to be signalled, and note the time it runs */
+static int slice_sleeper(int argl, void* args)
+{
+	Mutex_Lock(&slice_mx);
+	while(!slice_stop) {
+		while(!slice_go && !slice_stop)
+			Cond_Wait(&slice_mx, &slice_cv);
+		slice_go = 0;
+		mark_time(&slice_wake_time);
+		__atomic_add_fetch(&slice_woken, 1, __ATOMIC_RELEASE);
+	}
+	Mutex_Unlock(&slice_mx);
+	return 0;
+}
+
+/* 
+  Spin until the given time after the last wakeup of the sleeper, then
+  wake it up, spin until it runs and return how long that took. The 
+  sleeper waits for the time slice of the spinner to expire, and the 
+  spinner starts a new slice when the sleeper blocks again.
+*/
+static double slice_wake_after(double after)
+{
+	while(time_since(&slice_wake_time) < after)
+		;
+	int woken = __atomic_load_n(&slice_woken, __ATOMIC_ACQUIRE);
+
+	struct timeval t0;
+	mark_time(&t0);
+	Mutex_Lock(&slice_mx);
+	slice_go = 1;
+	Cond_Signal(&slice_cv);
+	Mutex_Unlock(&slice_mx);
+
+	while(__atomic_load_n(&slice_woken, __ATOMIC_ACQUIRE) == woken)
+		;
+	return time_since(&t0) - time_since(&slice_wake_time);
+}
+
+static int adaptive_slice_boot(int argl, void* args)
+{
+	slice_go = slice_woken = slice_stop = 0;
+	mark_time(&slice_wake_time);
+	Tid_t t = CreateThread(slice_sleeper, 0, NULL);
+
+	/* Sink to the lowest MLFQ level, where the quantum is 4*QUANTUM (40 msec) */
+	slice_wake_after(0.3);
+
+	/*
+		The sleeper was ready when the last slice expired, so the new slice
+		is a single quantum long: woken 10 msec into it, the sleeper runs 
+		after about 30 msec, not 70.
+	*/
+	ASSERT(slice_wake_after(0.01) < 0.05);
+
+	/*
+		Alone on the core, the slice doubles when it expires: woken 50 msec
+		into its slices, the sleeper runs at the end of the second (80 msec 
+		long) slice, after about 70 msec, not 30.
+	*/
+	ASSERT(slice_wake_after(0.05) > 0.05);
+
+	Mutex_Lock(&slice_mx);
+	slice_stop = 1;
+	Cond_Signal(&slice_cv);
+	Mutex_Unlock(&slice_mx);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	return 0;
+}
+
+BARE_TEST(test_adaptive_slice,
+	"Test that the time slice of a CPU-bound thread grows while it runs alone, and not under contention."
+	)
+{
+	boot(1, 0, adaptive_slice_boot, 0, NULL);
+}
+
 TEST_SUITE(user_tests, 
 	"These are tests defined by the user."
 	)
 {
 	&dummy_user_test,
+	&test_create_thread_stack,
+	&test_sched_policies,
+	&test_thread_rt,
+	&test_thread_priority,
+	&test_affinity,
+	&test_wide_affinity,
+	&test_load_balance,
+	&test_core_parking,
+	&test_priority_inheritance,
+	&test_host_cpu_pinning,
+	&test_fine_grained_locking,
+	&test_sleep_mutex,
+	&test_rwlock,
+	&test_broadcast_morphing,
+	&test_broadcast_from_interrupt,
+	&test_accept_skips_closed_requester,
+	&test_handoff_no_starvation,
+	&test_rt_admission_per_core,
+	&test_adaptive_slice,
 	NULL
 };
 